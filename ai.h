@@ -1,188 +1,981 @@
 #ifndef AI_H_
 #define AI_H_
 
-#include <sys/time.h>
+#include <time.h>
+#include <stdatomic.h>
+#include <unistd.h>
 
 #include "board.h"
 #include "legal_moves.h"
 #include "evaluation.h"
+#include "eval_cache.h"
+#include "transposition_table.h"
+#include "tablebase.h"
+#include "search_stack.h"
+#include "search_stats.h"
+#include "thread_pool.h"
 #include "stdlib.h"
 
-#define VALUE_DECAY_FACTOR 0.98
+// scores are in centipawns, from white's point of view
+// a mate is scored as MATE_VALUE minus the number of plies from the root
+// it takes to deliver it, so that shorter mates are preferred
+#define MATE_VALUE 32000
+#define MATE_BOUND (MATE_VALUE - MAX_PLY)
+#define VALUE_INFINITE 32001
 
+// a position the tablebases say is won scores this, minus the plies to the
+// conversion, which is more than any eval and less than any mate
+#define TB_WIN_VALUE (MATE_BOUND - 256)
+
+// stalemating the opponent is scored as if it lost this much, five pawns,
+// a checkmate could be worse, but try to prevent stalemate if possible
+#define STALEMATE_CONTEMPT 500
+
+// the depth the GUI searches to
 int SEARCH_DEPTH = 4;
 
-unsigned int n_states_explored = 0;
+// the most iterations the iterative deepening will ever do
+#define MAX_SEARCH_DEPTH 64
 
-typedef struct {
-    Move move;
-    float value;
-} MoveWithValue;
+uint64_t n_states_explored = 0;
+
+// set to make the running search return as soon as it can
+atomic_int search_stop = 0;
 
-int compare_two_moves(const void* a, const void* b)
+double get_time_milliseconds()
 {
-    const MoveWithValue* mva = (const MoveWithValue*) a;
-    const MoveWithValue* mvb = (const MoveWithValue*) b;
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1000.0 + t.tv_nsec / 1000000.0;
+}
+
+typedef struct
+{
+    /*
+     * SearchLimits tells choose_best_move when to stop, 0 means no limit
+     *
+     *   depth     the number of iterations of the iterative deepening
+     *   nodes     the number of states explored. A search limited only by
+     *             depth and nodes returns the same move and the same node
+     *             count on every run, on any machine, so it is the one to
+     *             benchmark changes with
+     *   movetime  milliseconds to spend on this move
+     *   wtime, btime, winc, binc
+     *             what's left on the clocks and the increments, in
+     *             milliseconds, the search budgets its own time out of these
+     *   mate      look for a mate in this many moves, and stop once one is found
+     *   infinite  search until search_stop is set, whatever the other limits say
+     *   multipv   how many of the best root moves to find exact values and
+     *             lines for, up to MAX_MULTIPV, 0 and 1 both mean just the best
+     */
+    int depth;
+    uint64_t nodes;
+    int movetime;
+    int wtime;
+    int btime;
+    int winc;
+    int binc;
+    int mate;
+    int infinite;
+    int multipv;
+} SearchLimits;
 
-    return (mva->value > mvb->value) - (mva->value < mvb->value);
+SearchLimits search_limits_for_depth(int depth)
+{
+    SearchLimits limits;
+    memset(&limits, 0, sizeof(limits));
+    limits.depth = depth;
+    return limits;
 }
 
-void create_move_value_array_from_move_array(game_state *s, const Move* moves, MoveWithValue* mwv, int n)
+// the limits of the running search, and the time they're counted from
+SearchLimits search_limits;
+double search_clock_start;
+double search_time_budget;
+int search_root_turn;
+int search_iteration_depth;
+int search_limit_reached;
+int search_nodes_until_clock_check;
+
+// a ponder hit hands the real limits to the running search through these
+SearchLimits ponderhit_limits;
+atomic_int ponderhit_pending = 0;
+
+#define NODES_BETWEEN_CLOCK_CHECKS 1024
+
+void budget_search_time()
 {
+    // how long this move may take, 0 if the clock doesn't matter
+    SearchLimits* limits = &search_limits;
+    search_time_budget = 0;
+    if (limits->infinite)
+        return;
+    if (limits->movetime)
+    {
+        search_time_budget = limits->movetime;
+        return;
+    }
+    int time_left = (search_root_turn == WHITE) ? limits->wtime : limits->btime;
+    int increment = (search_root_turn == WHITE) ? limits->winc : limits->binc;
+    if (time_left)
+    {
+        // assume the game goes on for another 30 moves, and never
+        // spend more than half of what is left
+        search_time_budget = time_left / 30.0 + increment * 0.75;
+        if (search_time_budget > time_left / 2.0)
+            search_time_budget = time_left / 2.0;
+    }
+}
+
+int search_max_depth()
+{
+    int depth = MAX_SEARCH_DEPTH;
+    if (search_limits.infinite)
+        return depth;
+    if (search_limits.depth && search_limits.depth < depth)
+        depth = search_limits.depth;
+    // a mate in n moves is 2n-1 plies, and the mated side has to be
+    // searched too to see that it has no moves left
+    if (search_limits.mate && 2 * search_limits.mate - 1 < depth)
+        depth = 2 * search_limits.mate - 1;
+    return depth;
+}
+
+void apply_ponderhit()
+{
+    // the opponent played the move we pondered on,
+    // from now on the real limits count
+    if (!atomic_load_explicit(&ponderhit_pending, memory_order_acquire))
+        return;
+    search_limits = ponderhit_limits;
+    search_clock_start = get_time_milliseconds();
+    budget_search_time();
+    atomic_store_explicit(&ponderhit_pending, 0, memory_order_relaxed);
+}
+
+int search_should_stop()
+{
+    apply_ponderhit();
+    if (atomic_load_explicit(&search_stop, memory_order_relaxed) || search_limit_reached)
+        return 1;
+    if (search_limits.infinite)
+        return 0;
+    if (search_limits.nodes && n_states_explored >= search_limits.nodes)
+        search_limit_reached = 1;
+    if (search_iteration_depth > search_max_depth())
+        search_limit_reached = 1;
+    if (search_time_budget && --search_nodes_until_clock_check <= 0)
+    {
+        search_nodes_until_clock_check = NODES_BETWEEN_CLOCK_CHECKS;
+        if (get_time_milliseconds() - search_clock_start >= search_time_budget)
+            search_limit_reached = 1;
+    }
+    return search_limit_reached;
+}
+
+// frontier pruning only kicks in when this many plies (or fewer) are left
+#define FRONTIER_PRUNING_DEPTH 3
+
+// margins for the frontier pruning, indexed by the remaining depth
+// these are in centipawns, like the eval: about a pawn a ply for futility,
+// razoring starts at two pawns
+Value FUTILITY_MARGIN[FRONTIER_PRUNING_DEPTH+1]         = {0, 100, 200, 300};
+Value REVERSE_FUTILITY_MARGIN[FRONTIER_PRUNING_DEPTH+1] = {0, 80, 160, 240};
+Value RAZORING_MARGIN[FRONTIER_PRUNING_DEPTH+1]         = {0, 200, 300, 400};
+
+// how many quiet moves get searched at a frontier node before
+// the rest of them are pruned, 0 for none. The moves one ply from the
+// leaves aren't sorted, so there the late ones are no worse than the rest
+int LATE_MOVE_PRUNING_COUNT[FRONTIER_PRUNING_DEPTH+1] = {0, 0, 12, 18};
+
+void sort_moves_by_static_eval(game_state* s, Move* moves, Value* scores, int n)
+{
+    // puts the moves that leave the side to move with the best eval first,
+    // moves that eval the same keep their order
     for (int i = 0; i < n; i++)
     {
-        mwv[i].move = moves[i];
         game_state new = make_move_2(s, moves[i]);
-        mwv[i].value = eval_comprehensive(&new) * ((s->turn == WHITE) ? -1.0 : 1.0);
+        scores[i] = EVAL_IN_PHASE(EP_ORDERING, eval_cached(&new)) * ((s->turn == WHITE) ? -1 : 1);
+    }
+    for (int i = 1; i < n; i++)
+    {
+        Move m = moves[i];
+        Value score = scores[i];
+        int j = i;
+        for (; j > 0 && scores[j - 1] > score; j--)
+        {
+            moves[j] = moves[j - 1];
+            scores[j] = scores[j - 1];
+        }
+        moves[j] = m;
+        scores[j] = score;
+    }
+}
+
+Value max(Value a, Value b)
+{
+    return (a > b) ? a : b;
+}
+
+Value min(Value a, Value b)
+{
+    return (a < b) ? a : b;
+}
+
+int is_mate_value(Value v)
+{
+    return v >= MATE_BOUND || v <= -MATE_BOUND;
+}
+
+Value value_to_tt(Value v, int ply)
+{
+    // mate scores are counted from the root, but a transposition table
+    // entry can be probed from anywhere in the tree, so they get stored
+    // counted from the node instead
+    if (v >= MATE_BOUND)
+        return v + ply;
+    if (v <= -MATE_BOUND)
+        return v - ply;
+    return v;
+}
+
+Value value_from_tt(Value v, int ply)
+{
+    // the inverse of value_to_tt, for the node at `ply`
+    if (v >= MATE_BOUND)
+        return v - ply;
+    if (v <= -MATE_BOUND)
+        return v + ply;
+    return v;
+}
+
+int is_quiet_move(game_state* s, Move m)
+{
+    // a quiet move captures nothing and promotes nothing
+    int from = get_from_bits(m);
+    int to = get_to_bits(m);
+    if (get_promotion_bits(m))
+        return 0;
+    if (!is_blank(s->squares[to]))
+        return 0;
+    if (is_pawn(s->squares[from]) && to == s->en_passant)
+        return 0;
+    return 1;
+}
+
+int is_side_to_move_in_check(game_state* s)
+{
+    return is_king_in_check(s, find_piece(s, (s->turn == WHITE) ? W_KING : B_KING));
+}
+
+Value quiescence_search(game_state* s, int ply, Value alpha, Value beta)
+{
+    // searches only the captures until the position is quiet, so that
+    // the static eval isn't taken in the middle of an exchange
+    n_states_explored ++;
+    search_counters.quiescence_nodes ++;
+
+    // only how the stand pat compares to the window matters
+    // when it's far outside it
+    Value stand_pat = EVAL_IN_PHASE(EP_QUIESCENCE, eval_cached_lazily(s, alpha, beta));
+    if (ply >= MAX_PLY)
+        return stand_pat;
+    if (s->turn == WHITE)
+    {
+        if (stand_pat >= beta)
+            return stand_pat;
+        alpha = max(alpha, stand_pat);
+    } else {
+        if (stand_pat <= alpha)
+            return stand_pat;
+        beta = min(beta, stand_pat);
     }
+
+    Value best_val = stand_pat;
+    Move* moves = search_stack[ply].moves;
+    int n_moves = get_legal_moves_as_move_array(s, moves);
+    for (int i = 0; i < n_moves; i++)
+    {
+        if (is_quiet_move(s, moves[i]))
+            continue;
+        game_state new_state = make_move_2(s, moves[i]);
+        Value val_of_new_state = quiescence_search(&new_state, ply + 1, alpha, beta);
+        if (s->turn == WHITE)
+        {
+            best_val = max(best_val, val_of_new_state);
+            alpha = max(alpha, val_of_new_state);
+            if (val_of_new_state >= beta)
+                break;
+        } else {
+            best_val = min(best_val, val_of_new_state);
+            beta = min(beta, val_of_new_state);
+            if (val_of_new_state <= alpha)
+                break;
+        }
+    }
+    return best_val;
 }
 
-void create_move_array_from_move_value_array(const MoveWithValue* mwvs, Move* moves, int n)
+void move_to_front(Move* moves, int n, Move m)
 {
+    // puts `m` first and keeps the order of the rest of the moves
     for (int i = 0; i < n; i++)
     {
-        moves[i] = mwvs[i].move;
+        if (moves[i] == m)
+        {
+            memmove(moves + 1, moves, i * sizeof(Move));
+            moves[0] = m;
+            return;
+        }
     }
 }
 
-void sort_moves_by_static_eval(game_state* s, Move* moves, int n)
+int is_better_for(int player, Value a, Value b)
 {
-    MoveWithValue mwvs[n];
-    create_move_value_array_from_move_array(s, moves, mwvs, n);
-    qsort(mwvs, n, sizeof(MoveWithValue), &compare_two_moves);
-    create_move_array_from_move_value_array(mwvs, moves, n);
+    // is `a` strictly better than `b` for `player`
+    return (player == WHITE) ? a > b : a < b;
 }
 
-float max(float a, float b)
+int get_pv_from_tt(game_state* s, Move first_move, Move* pv, int max_length)
 {
-    return (a > b) ? a : b;
+    /*
+     * follows the best moves the transposition table remembers, starting
+     * with `first_move` from `s`, and writes them to `pv`
+     * returns the length of the line
+     */
+    Move moves[256];
+    game_state state = make_move_2(s, first_move);
+    pv[0] = first_move;
+    int length = 1;
+    while (length < max_length)
+    {
+        TTEntry* entry = tt_probe(state.hash);
+        if (entry == NULL || entry->move == 0)
+            break;
+        // a different state with the same index bits can leave a move that isn't legal here
+        int n_moves = get_legal_moves_as_move_array(&state, moves);
+        int legal = 0;
+        for (int i = 0; i < n_moves; i++)
+            legal |= (moves[i] == entry->move);
+        if (!legal)
+            break;
+        pv[length++] = entry->move;
+        state = make_move_2(&state, entry->move);
+    }
+    return length;
 }
 
-float min(float a, float b)
+Value tablebase_value(game_state* s, int wdl, int distance)
 {
-    return (a < b) ? a : b;
+    Value v = 0;
+    if (wdl == TB_WIN)
+        v = TB_WIN_VALUE - distance;
+    else if (wdl == TB_LOSS)
+        v = -TB_WIN_VALUE + distance;
+    return (s->turn == WHITE) ? v : -v;
 }
 
-float minimax_eval_alpha_beta_pruning(game_state*s, int depth, float alpha, float beta)
+void count_cutoff(int n_moves_searched)
 {
+    search_counters.cutoffs ++;
+    if (n_moves_searched == 1)
+        search_counters.first_move_cutoffs ++;
+}
+
+Value minimax_eval_alpha_beta_pruning(game_state*s, int depth, int ply, Value alpha, Value beta)
+{
+    // the value returned after a stop is garbage, the caller throws it away
+    if (search_should_stop())
+        return 0;
+
     n_states_explored ++;
+    search_counters.nodes ++;
+
+    // with few enough pieces left, the tablebases know the real value
+    if (tb_max_pieces && popcount(s->white_pieces | s->black_pieces) <= tb_max_pieces)
+    {
+        int wdl, distance;
+        search_counters.tb_probes ++;
+        if (tb_probe(s, &wdl, &distance))
+        {
+            search_counters.tb_hits ++;
+            return tablebase_value(s, wdl, distance);
+        }
+    }
+    // the bitbases only know who wins, so they settle the draws,
+    // the wins are left to the eval to make progress in
+    int bitbase_wdl;
+    if (bitbase_probe(s, &bitbase_wdl))
+    {
+        search_counters.bitbase_hits ++;
+        if (bitbase_wdl == TB_DRAW)
+            return 0;
+    }
+
     if (depth == 0)
-        return eval_comprehensive(s);
+        return EVAL_IN_PHASE(EP_LEAF, eval_cached_lazily(s, alpha, beta));
+
+    // mate distance pruning: nothing found below this node can
+    // beat a mate that is closer to the root
+    int window_was_open = alpha < beta;
+    alpha = max(alpha, -MATE_VALUE + ply);
+    beta = min(beta, MATE_VALUE - ply);
+    if (alpha >= beta)
+    {
+        if (window_was_open)
+            search_counters.mate_distance_pruned ++;
+        return alpha;
+    }
 
-    float best_val;
+    Move tt_move = 0;
+    search_counters.tt_probes ++;
+    TTEntry* entry = tt_probe(s->hash);
+    if (entry != NULL)
+    {
+        search_counters.tt_hits ++;
+        tt_move = entry->move;
+        if (entry->depth >= depth)
+        {
+            Value tt_value = value_from_tt(entry->value, ply);
+            if (entry->bound == BOUND_EXACT
+                || (entry->bound == BOUND_LOWER && tt_value >= beta)
+                || (entry->bound == BOUND_UPPER && tt_value <= alpha))
+            {
+                search_counters.tt_cutoffs ++;
+                return tt_value;
+            }
+        }
+    }
+    Value original_alpha = alpha;
+    Value original_beta = beta;
+
+    // the search stack ends here, like the quiescence search does
+    if (ply >= MAX_PLY)
+        return EVAL_IN_PHASE(EP_LEAF, eval_cached(s));
+    SearchStackEntry* ss = &search_stack[ply];
+    int in_check = is_side_to_move_in_check(s);
+
+    // near the leaves, a static eval that is far outside the window
+    // tells us most of what the search would
+    int frontier_node = (depth <= FRONTIER_PRUNING_DEPTH) && !in_check;
+    Value static_eval = 0;
+    if (frontier_node)
+    {
+        static_eval = EVAL_IN_PHASE(EP_FRONTIER, eval_cached(s));
+        ss->static_eval = static_eval;
+
+        // reverse futility pruning: we're so far ahead that the
+        // opponent will avoid this position anyway
+        if ((s->turn == WHITE && static_eval - REVERSE_FUTILITY_MARGIN[depth] >= beta)
+            || (s->turn == BLACK && static_eval + REVERSE_FUTILITY_MARGIN[depth] <= alpha))
+        {
+            search_counters.reverse_futility_pruned ++;
+            return static_eval;
+        }
+
+        // razoring: we're so far behind that only a capture could help,
+        // so check that with the quiescence search and give up if it can't
+        if (s->turn == WHITE && static_eval + RAZORING_MARGIN[depth] < alpha)
+        {
+            Value val = quiescence_search(s, ply, alpha, beta);
+            if (val < alpha)
+            {
+                search_counters.razored ++;
+                return val;
+            }
+        }
+        if (s->turn == BLACK && static_eval - RAZORING_MARGIN[depth] > beta)
+        {
+            Value val = quiescence_search(s, ply, alpha, beta);
+            if (val > beta)
+            {
+                search_counters.razored ++;
+                return val;
+            }
+        }
+    }
+
+    // futility pruning: a quiet move can't bring the eval back into the window
+    int quiet_moves_are_futile = frontier_node && ((s->turn == WHITE)
+        ? (static_eval + FUTILITY_MARGIN[depth] <= alpha)
+        : (static_eval - FUTILITY_MARGIN[depth] >= beta));
+    int n_quiet_moves_searched = 0;
+    int n_moves_searched = 0;
+
+    Value best_val;
+    Move best_move = 0;
     if (s->turn == WHITE)
-        best_val = -1000000;
+        best_val = -VALUE_INFINITE;
     else {
-        best_val =  1000000;
+        best_val =  VALUE_INFINITE;
     }
 
-    Move moves[256];
+    Move* moves = ss->moves;
     int n_moves = get_legal_moves_as_move_array(s, moves);
     if (n_moves == 0)
     {
-        if (is_king_in_check(s, find_piece(s, (s->turn==WHITE)? W_KING : B_KING)))
-            return s->turn ? 1000 : -1000;
+        if (in_check)
+            return (s->turn == WHITE) ? -MATE_VALUE + ply : MATE_VALUE - ply;
         else {
             // stalemate
-            // a checkmate could be worse, but try to prevent stalemate if possible
-            return s->turn ? -500 : 500;
+            return (s->turn == WHITE) ? STALEMATE_CONTEMPT : -STALEMATE_CONTEMPT;
         }
     }
     if (depth > 1)
-        sort_moves_by_static_eval(s, moves, n_moves);
+        sort_moves_by_static_eval(s, moves, ss->scores, n_moves);
+    // the killers go right after the best move from the table
+    for (int k = 1; k >= 0; k--)
+        if (ss->killers[k] != 0 && is_quiet_move(s, ss->killers[k]))
+            move_to_front(moves, n_moves, ss->killers[k]);
+    if (tt_move != 0)
+        move_to_front(moves, n_moves, tt_move);
     for (int i = 0; i < n_moves; i++)
     {
+        int quiet = is_quiet_move(s, moves[i]);
         game_state new_state = make_move_2(s, moves[i]);
-        float val_of_new_state = VALUE_DECAY_FACTOR * minimax_eval_alpha_beta_pruning(&new_state, depth-1, alpha, beta);
+        if (frontier_node && quiet && i > 0)
+        {
+            // late move pruning: the move ordering puts the good quiet
+            // moves first, so the late ones rarely matter this close to the leaves
+            int late_move = LATE_MOVE_PRUNING_COUNT[depth] > 0
+                && n_quiet_moves_searched >= LATE_MOVE_PRUNING_COUNT[depth];
+            if ((quiet_moves_are_futile || late_move) && !is_side_to_move_in_check(&new_state))
+            {
+                if (quiet_moves_are_futile)
+                    search_counters.futility_pruned ++;
+                else
+                    search_counters.late_move_pruned ++;
+                continue;
+            }
+        }
+        if (quiet)
+            n_quiet_moves_searched++;
+        n_moves_searched++;
+        Value val_of_new_state = minimax_eval_alpha_beta_pruning(&new_state, depth-1, ply+1, alpha, beta);
         if (s->turn == WHITE)
         {
-            best_val = max(best_val, val_of_new_state);
+            if (val_of_new_state > best_val)
+            {
+                best_val = val_of_new_state;
+                best_move = moves[i];
+            }
             alpha = max(alpha, val_of_new_state);
             if (val_of_new_state > beta)
             {
+                count_cutoff(n_moves_searched);
+                if (quiet)
+                    search_stack_add_killer(ply, moves[i]);
                 break;
             }
         } else {
-            best_val = min(best_val, val_of_new_state);
+            if (val_of_new_state < best_val)
+            {
+                best_val = val_of_new_state;
+                best_move = moves[i];
+            }
             beta = min(beta, val_of_new_state);
             if (val_of_new_state < alpha)
             {
+                count_cutoff(n_moves_searched);
+                if (quiet)
+                    search_stack_add_killer(ply, moves[i]);
                 break;
             }
         }
     }
+
+    if (search_should_stop())
+        return 0;
+
+    int bound = BOUND_EXACT;
+    if (best_val <= original_alpha)
+        bound = BOUND_UPPER;
+    else if (best_val >= original_beta)
+        bound = BOUND_LOWER;
+    tt_store(s->hash, value_to_tt(best_val, ply), best_move, depth, bound);
     return best_val;
 }
 
-int choose_best_move(game_state* s, Move* move, double* time_taken_for_search_milliseconds)
+int choose_best_move(game_state* s, const SearchLimits* limits, Move* move, double* time_taken_for_search_milliseconds)
 {
-    struct timeval t1, t2;
+    /*
+     * Searches `s` with iterative deepening, one ply deeper at a time until
+     * one of the `limits` is hit, each iteration starting from the previous
+     * one's best move and reusing what it left in the transposition table
+     *
+     * With limits->multipv set to n, the root window is kept open down to
+     * the n-th best value found so far instead of the best one, so the n
+     * best moves all get exact values in the same pass, sharing the table,
+     * and go first in the next iteration. Their lines end up in search_stats
+     *
+     * returns 1 if a move was found
+     *        -1 if there are no legal moves, or the search was stopped
+     *           before it finished its first iteration
+     */
     n_states_explored = 0;
+    search_stats.n_depths = 0;
+    EVAL_PROFILE_CLEAR();
+    search_limits = *limits;
+    search_limit_reached = 0;
+    search_nodes_until_clock_check = NODES_BETWEEN_CLOCK_CHECKS;
 
-    float best_val;
-    int best_to;
-    int best_from;
+    // a fixed-node search has to start from the same table every time to be reproducible
+    if (limits->nodes && !limits->movetime && !limits->wtime && !limits->btime && !limits->infinite)
+        tt_clear();
+    tt_new_search();
 
     int ret = -1;
 
-    if (s->turn == WHITE)
-    {
-        best_val =  -1000000;
-    } else {
-        best_val = 1000000;
-    }
-
     // starting search
-    gettimeofday(&t1, NULL);
+    double start_time = get_time_milliseconds();
+    search_clock_start = start_time;
+    search_root_turn = s->turn;
+    budget_search_time();
 
-    Move moves[256];
-    Move best_move;
+    search_stack_clear();
+    Move* moves = search_stack[0].moves;
+    Move best_move = 0;
     int n_moves = get_legal_moves_as_move_array(s, moves);
-    for (int i = 0; i < n_moves; i++)
+    // the tablebases can tell which moves keep the result, and which get
+    // there fastest, the search only has to choose among those
+    if (tb_max_pieces)
+        n_moves = tb_filter_root_moves(s, moves, n_moves);
+    if (n_moves > 1)
+        sort_moves_by_static_eval(s, moves, search_stack[0].scores, n_moves);
+
+    int n_lines = (limits->multipv > 1) ? limits->multipv : 1;
+    if (n_lines > MAX_MULTIPV)
+        n_lines = MAX_MULTIPV;
+    if (n_lines > n_moves)
+        n_lines = n_moves;
+
+    for (int depth = 1; n_moves > 0; depth++)
     {
-        int from = get_from_bits(moves[i]);
-        int to = get_to_bits(moves[i]);
+        search_iteration_depth = depth;
+        if (search_should_stop())
+            break;
 
+        Value alpha = -VALUE_INFINITE;
+        Value beta = VALUE_INFINITE;
+        // the best n_lines moves so far, best first
+        Move line_moves[MAX_MULTIPV];
+        Value line_values[MAX_MULTIPV];
+        uint64_t line_nodes[MAX_MULTIPV];
+        int n_found = 0;
+        memset(&search_counters, 0, sizeof(search_counters));
 
-        game_state new_state = make_move_2(s, moves[i]);
-        float val_of_new_state = minimax_eval_alpha_beta_pruning(&new_state,SEARCH_DEPTH, -1000000, 1000000);
-        if (s->turn == WHITE)
+        for (int i = 0; i < n_moves; i++)
         {
-            if (best_val <= val_of_new_state)
+            uint64_t nodes_before = n_states_explored;
+            game_state new_state = make_move_2(s, moves[i]);
+            Value val_of_new_state = minimax_eval_alpha_beta_pruning(&new_state, depth, 1, alpha, beta);
+            if (search_should_stop())
+                break;
+            if (n_found == n_lines && !is_better_for(s->turn, val_of_new_state, line_values[n_lines - 1]))
+                continue;
+
+            // insert it after the ones at least as good, dropping the worst if there's no room
+            int j = (n_found < n_lines) ? n_found++ : n_lines - 1;
+            for (; j > 0 && is_better_for(s->turn, val_of_new_state, line_values[j - 1]); j--)
             {
-                best_val = val_of_new_state;
-                best_move = moves[i];
-                best_from = from;
-                best_to = to;
-                ret = 1;
+                line_moves[j] = line_moves[j - 1];
+                line_values[j] = line_values[j - 1];
+                line_nodes[j] = line_nodes[j - 1];
             }
-        } else {
-            if (best_val >= val_of_new_state)
+            line_moves[j] = moves[i];
+            line_values[j] = val_of_new_state;
+            line_nodes[j] = n_states_explored - nodes_before;
+
+            // only a move better than the worst of the lines can still change them
+            if (n_found == n_lines)
             {
-                best_val = val_of_new_state;
-                best_move = moves[i];
-                best_from = from;
-                best_to = to;
-                ret = 1;
+                if (s->turn == WHITE)
+                    alpha = line_values[n_lines - 1];
+                else
+                    beta = line_values[n_lines - 1];
+            }
+        }
+        // an unfinished iteration can't be trusted, keep the last finished one
+        if (search_should_stop())
+            break;
+
+        Value best_val = line_values[0];
+        best_move = line_moves[0];
+        ret = 1;
+        for (int j = n_found - 1; j >= 0; j--)
+            move_to_front(moves, n_moves, line_moves[j]);
+        tt_store(s->hash, value_to_tt(best_val, 0), best_move, depth + 1, BOUND_EXACT);
+
+        if (search_stats.n_depths < SEARCH_STATS_MAX_DEPTH)
+        {
+            SearchDepthStats* stats = &search_stats.depths[search_stats.n_depths++];
+            stats->depth = depth;
+            stats->counters = search_counters;
+            stats->time_milliseconds = get_time_milliseconds() - start_time;
+            stats->best_move = best_move;
+            stats->value = best_val;
+            stats->n_lines = n_found;
+            for (int j = 0; j < n_found; j++)
+            {
+                SearchLine* line = &stats->lines[j];
+                line->value = line_values[j];
+                line->nodes = line_nodes[j];
+                line->length = get_pv_from_tt(s, line_moves[j], line->moves, MAX_PV_LENGTH);
             }
         }
+
+        // there are no more depths to search, an infinite search waits to
+        // be stopped, or for a ponderhit to bring limits that end it
+        if (depth >= MAX_SEARCH_DEPTH)
+        {
+            while (search_limits.infinite && !search_should_stop())
+                usleep(1000);
+            break;
+        }
+        // going deeper can't find a faster mate, once every line has found one
+        if (is_mate_value(line_values[n_found - 1]) && !search_limits.infinite)
+            break;
+        // the next iteration takes a few times as long as this one,
+        // don't start one that won't finish
+        apply_ponderhit();
+        if (search_time_budget && get_time_milliseconds() - search_clock_start > search_time_budget / 2)
+            break;
     }
     // ending seach
-    gettimeofday(&t2, NULL);
+    *time_taken_for_search_milliseconds = get_time_milliseconds() - start_time;
+    if (search_stats_output != NULL)
+        search_stats_write_json_lines(search_stats_output, &search_stats);
+    EVAL_PROFILE_PRINT(stderr);
+    *move = best_move;
+    return ret;
+}
 
-    int secs = t2.tv_sec - t1.tv_sec;
-    int usecs = t2.tv_usec - t1.tv_usec;
+// the searcher pondering and AsyncSearch run, choose_best_move_mcts can take its place
+int (*search_function)(game_state* s, const SearchLimits* limits, Move* move, double* time_taken_for_search_milliseconds) = &choose_best_move;
 
-    if(usecs < 0)
+typedef struct
+{
+    /*
+     * PonderState keeps the search that runs on the opponent's time
+     *
+     * After the engine plays, it guesses the opponent's reply (the best
+     * move the search found for it) and starts searching the position
+     * after that reply on the pool. If the opponent plays the guess,
+     * that search is simply kept and its result used, otherwise it is
+     * stopped and thrown away, but the transposition table keeps
+     * whatever it learnt
+     */
+    ThreadPool* pool;
+    Future future;
+    int active;
+    SearchLimits limits;
+    game_state position;
+    Move predicted_reply;
+    Move move;
+    int ret;
+    double time_taken_for_search_milliseconds;
+} PonderState;
+
+void construct_new_ponder_state(PonderState* p, ThreadPool* pool)
+{
+    p->pool = pool;
+    p->active = 0;
+    p->predicted_reply = 0;
+}
+
+void ponder_task(void* arg)
+{
+    PonderState* p = (PonderState*) arg;
+    p->ret = search_function(&p->position, &p->limits, &p->move, &p->time_taken_for_search_milliseconds);
+}
+
+int predict_reply(game_state* s, Move* reply)
+{
+    // the reply the last search expected, if it is still in the table
+    // and still legal in `s`
+    TTEntry* entry = tt_probe(s->hash);
+    if (entry == NULL || entry->move == 0)
+        return 0;
+    Move moves[256];
+    int n_moves = get_legal_moves_as_move_array(s, moves);
+    for (int i = 0; i < n_moves; i++)
     {
-        --secs;
-        usecs += 1000000;
+        if (moves[i] == entry->move)
+        {
+            *reply = entry->move;
+            return 1;
+        }
     }
+    return 0;
+}
 
-    *time_taken_for_search_milliseconds = (secs * 1000 + usecs / 1000.0 + 0.5);
-    //fprintf(stderr, "Explored %u states in %F milliseconds.\n", n_states_explored, *time_taken_for_search_milliseconds);
-    *move = best_move;
-    return ret;
+void start_pondering(PonderState* p, game_state* s)
+{
+    // `s` is the state right after the engine's move, with the opponent to play
+    // the ponder search has no limits until the ponder hit gives it some
+    if (p->active || !predict_reply(s, &p->predicted_reply))
+        return;
+    p->position = make_move_2(s, p->predicted_reply);
+    p->limits = search_limits_for_depth(0);
+    p->limits.infinite = 1;
+    atomic_store(&search_stop, 0);
+    atomic_store(&ponderhit_pending, 0);
+    p->active = 1;
+    thread_pool_submit(p->pool, &p->future, &ponder_task, p);
+}
+
+void stop_pondering(PonderState* p)
+{
+    if (!p->active)
+        return;
+    atomic_store(&search_stop, 1);
+    future_wait(p->pool, &p->future);
+    atomic_store(&search_stop, 0);
+    p->active = 0;
+}
+
+int choose_best_move_after_pondering(PonderState* p, game_state* s, const SearchLimits* limits,
+        Move* move, double* time_taken_for_search_milliseconds)
+{
+    // same as choose_best_move, but on a ponder hit the ponder search
+    // gets `limits` and carries on, instead of starting over
+    if (p->active && p->position.hash == s->hash)
+    {
+        ponderhit_limits = *limits;
+        atomic_store_explicit(&ponderhit_pending, 1, memory_order_release);
+        future_wait(p->pool, &p->future);
+        p->active = 0;
+        *move = p->move;
+        *time_taken_for_search_milliseconds = p->time_taken_for_search_milliseconds;
+        return p->ret;
+    }
+    stop_pondering(p);
+    return search_function(s, limits, move, time_taken_for_search_milliseconds);
+}
+
+typedef struct AsyncSearch AsyncSearch;
+
+struct AsyncSearch
+{
+    /*
+     * AsyncSearch runs choose_best_move on the pool, so the thread that
+     * starts it (the SDL loop) never waits on it
+     *
+     *   async_search_start   starts searching a copy of the position,
+     *                        taking over the ponder search on a ponder hit
+     *   async_search_poll    returns 1 once, when the search is done, and
+     *                        calls `on_done` right there, on the polling thread
+     *   async_search_stop    makes it finish now with the best move it has,
+     *                        the move still arrives through the next poll
+     *   async_search_cancel  stops it and throws the result away
+     */
+    ThreadPool* pool;
+    PonderState* ponder;
+    Future future;
+    int active;
+    // the ponder search is the one running, `future` isn't used
+    int from_ponder;
+    game_state position;
+    SearchLimits limits;
+    Move move;
+    int ret;
+    double time_taken_for_search_milliseconds;
+    void (*on_done)(AsyncSearch* a, void* arg);
+    void* on_done_arg;
+};
+
+void construct_new_async_search(AsyncSearch* a, ThreadPool* pool, PonderState* ponder)
+{
+    a->pool = pool;
+    a->ponder = ponder;
+    a->active = 0;
+    a->from_ponder = 0;
+}
+
+void async_search_task(void* arg)
+{
+    AsyncSearch* a = (AsyncSearch*) arg;
+    a->ret = search_function(&a->position, &a->limits, &a->move, &a->time_taken_for_search_milliseconds);
+    // stopped before the first iteration finished, any legal move beats none
+    if (a->ret == -1)
+    {
+        Move* moves = search_stack[0].moves;
+        if (get_legal_moves_as_move_array(&a->position, moves) > 0)
+        {
+            a->move = moves[0];
+            a->ret = 1;
+        }
+    }
+}
+
+void async_search_start(AsyncSearch* a, game_state* s, const SearchLimits* limits,
+        void (*on_done)(AsyncSearch* a, void* arg), void* on_done_arg)
+{
+    if (a->active)
+        return;
+    a->position = *s;
+    a->limits = *limits;
+    a->on_done = on_done;
+    a->on_done_arg = on_done_arg;
+    a->active = 1;
+
+    PonderState* p = a->ponder;
+    if (p != NULL && p->active && p->position.hash == s->hash)
+    {
+        ponderhit_limits = *limits;
+        atomic_store_explicit(&ponderhit_pending, 1, memory_order_release);
+        a->from_ponder = 1;
+        return;
+    }
+    if (p != NULL)
+        stop_pondering(p);
+    a->from_ponder = 0;
+    atomic_store(&search_stop, 0);
+    thread_pool_submit(a->pool, &a->future, &async_search_task, a);
+}
+
+Future* async_search_future(AsyncSearch* a)
+{
+    return a->from_ponder ? &a->ponder->future : &a->future;
+}
+
+void async_search_collect(AsyncSearch* a)
+{
+    // the search is done, take its result
+    if (a->from_ponder)
+    {
+        a->move = a->ponder->move;
+        a->ret = a->ponder->ret;
+        a->time_taken_for_search_milliseconds = a->ponder->time_taken_for_search_milliseconds;
+        a->ponder->active = 0;
+    }
+    a->active = 0;
+    atomic_store(&search_stop, 0);
+}
+
+int async_search_poll(AsyncSearch* a)
+{
+    if (!a->active || !future_is_ready(async_search_future(a)))
+        return 0;
+    async_search_collect(a);
+    if (a->on_done != NULL)
+        a->on_done(a, a->on_done_arg);
+    return 1;
+}
+
+void async_search_stop(AsyncSearch* a)
+{
+    if (a->active)
+        atomic_store(&search_stop, 1);
+}
+
+void async_search_cancel(AsyncSearch* a)
+{
+    if (!a->active)
+        return;
+    atomic_store(&search_stop, 1);
+    future_wait(a->pool, async_search_future(a));
+    async_search_collect(a);
 }
 
 #endif // AI_H_
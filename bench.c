@@ -0,0 +1,476 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "board.h"
+#include "legal_moves.h"
+#include "thread_pool.h"
+#include "ai.h"
+#include "opening_book.h"
+#include "mate_solver.h"
+#include "mcts.h"
+#include "nnue.h"
+#include "eval_batch.h"
+
+/*
+ * Headless benchmarks, no SDL needed
+ *
+ *   bench.out threads [n_workers]       thread pool task overhead and scaling
+ *   bench.out perft <depth> [fen]       serial and parallel perft
+ *   bench.out search [limits] [fen <fen>]
+ *                                       search statistics per depth, as JSON lines
+ *                                       the limits are written like UCI's go command,
+ *                                       e.g. "depth 5" or "nodes 100000" or "movetime 500",
+ *                                       "multipv <n>" ranks the n best moves,
+ *                                       "tablebases <directory>" probes the tables there,
+ *                                       "bitbases <directory>" the bitbases,
+ *                                       "book <file.bin>" plays from a Polyglot
+ *                                       book before searching,
+ *                                       "searcher mcts" searches with MCTS instead,
+ *                                       on "threads <n>" workers, with "selection uct"
+ *                                       or "selection puct" and "playout <plies>" random
+ *                                       plies before the leaf eval, nodes count playouts
+ *   bench.out mate [limits] [fen <fen>]  looks for a forced mate with the proof-number
+ *                                       search, "mate <n>" for a mate in n moves, or
+ *                                       at any depth without it, "nodes" and "movetime"
+ *                                       limit it
+ *   bench.out nnue <network> [n_positions]
+ *                                       evals per second of the classical eval and of
+ *                                       the network, updated and from scratch, and how
+ *                                       far apart the two evals are, on positions from
+ *                                       random games
+ *   bench.out batch [n_positions]       evals per second of eval_comprehensive and of
+ *                                       evaluate_batch, which kernel the batch used,
+ *                                       and how many of the evals differ, on positions
+ *                                       from random games
+ */
+
+// the workers MCTS searches on, 0 for one per core
+int mcts_n_threads = 0;
+
+void parse_search_limits(int argc, char *argv[], SearchLimits* limits, char** fen)
+{
+    char* book_file_name = NULL;
+    *limits = search_limits_for_depth(0);
+    for (int i = 0; i < argc; i++)
+    {
+        char* value = (i + 1 < argc) ? argv[i+1] : "0";
+        if (strcmp(argv[i], "infinite") == 0)
+            limits->infinite = 1;
+        else if (strcmp(argv[i], "depth") == 0)    { limits->depth = atoi(value); i++; }
+        else if (strcmp(argv[i], "nodes") == 0)    { limits->nodes = strtoull(value, NULL, 10); i++; }
+        else if (strcmp(argv[i], "movetime") == 0) { limits->movetime = atoi(value); i++; }
+        else if (strcmp(argv[i], "wtime") == 0)    { limits->wtime = atoi(value); i++; }
+        else if (strcmp(argv[i], "btime") == 0)    { limits->btime = atoi(value); i++; }
+        else if (strcmp(argv[i], "winc") == 0)     { limits->winc = atoi(value); i++; }
+        else if (strcmp(argv[i], "binc") == 0)     { limits->binc = atoi(value); i++; }
+        else if (strcmp(argv[i], "mate") == 0)     { limits->mate = atoi(value); i++; }
+        else if (strcmp(argv[i], "multipv") == 0)  { limits->multipv = atoi(value); i++; }
+        else if (strcmp(argv[i], "fen") == 0)      { *fen = value; i++; }
+        else if (strcmp(argv[i], "tablebases") == 0)
+        {
+            if (tb_init(value) == -1)
+                fprintf(stderr, "Can't read the tablebases in %s\n", value);
+            i++;
+        }
+        else if (strcmp(argv[i], "bitbases") == 0) { bitbase_init(value); i++; }
+        else if (strcmp(argv[i], "book") == 0)     { book_file_name = value; i++; }
+        else if (strcmp(argv[i], "searcher") == 0)
+        {
+            search_function = (strcmp(value, "mcts") == 0) ? &choose_best_move_mcts : &choose_best_move;
+            i++;
+        }
+        else if (strcmp(argv[i], "threads") == 0)  { mcts_n_threads = atoi(value); i++; }
+        else if (strcmp(argv[i], "selection") == 0)
+        {
+            mcts_options.selection = (strcmp(value, "uct") == 0) ? MCTS_UCT : MCTS_PUCT;
+            i++;
+        }
+        else if (strcmp(argv[i], "playout") == 0)  { mcts_options.playout_plies = atoi(value); i++; }
+        else if (strcmp(argv[i], "nnue") == 0)     { nnue_init(value); i++; }
+    }
+    if (book_file_name != NULL)
+        book_init(book_file_name);
+    if (!limits->depth && !limits->nodes && !limits->movetime && !limits->wtime
+            && !limits->btime && !limits->mate && !limits->infinite)
+        limits->depth = SEARCH_DEPTH;
+}
+
+typedef struct
+{
+    game_state* s;
+    Move* moves;
+    int depth;
+    uint64_t* n_leaves;
+} PerftJob;
+
+void perft_root_moves(int begin, int end, void* arg)
+{
+    PerftJob* job = (PerftJob*) arg;
+    for (int i = begin; i < end; i++)
+    {
+        game_state new_state = make_move_2(job->s, job->moves[i]);
+        job->n_leaves[i] = perft(&new_state, job->depth - 1);
+    }
+}
+
+uint64_t parallel_perft(ThreadPool* pool, game_state* s, int depth)
+{
+    // perft with the root moves spread over the pool
+    if (depth == 0)
+        return 1;
+    Move moves[256];
+    uint64_t n_leaves[256];
+    int n_moves = get_legal_moves_as_move_array(s, moves);
+    PerftJob job = {s, moves, depth, n_leaves};
+    thread_pool_parallel_for(pool, 0, n_moves, 1, &perft_root_moves, &job);
+
+    uint64_t total = 0;
+    for (int i = 0; i < n_moves; i++)
+        total += n_leaves[i];
+    return total;
+}
+
+void empty_task(void* arg)
+{
+    (void) arg;
+}
+
+void empty_range(int begin, int end, void* arg)
+{
+    (void) begin;
+    (void) end;
+    (void) arg;
+}
+
+typedef struct
+{
+    ThreadPool* pool;
+    int n_children;
+    Future* children;
+} SpawnJob;
+
+void spawn_children_task(void* arg)
+{
+    // submits from inside a worker, so the tasks go through the deques
+    SpawnJob* job = (SpawnJob*) arg;
+    for (int i = 0; i < job->n_children; i++)
+        thread_pool_submit(job->pool, &job->children[i], &empty_task, NULL);
+    for (int i = 0; i < job->n_children; i++)
+        future_wait(job->pool, &job->children[i]);
+}
+
+void bench_task_overhead(ThreadPool* pool)
+{
+    const int n_tasks = 100000;
+    Future* futures = malloc(n_tasks * sizeof(Future));
+    double t1, t2;
+
+    t1 = get_time_milliseconds();
+    for (int i = 0; i < n_tasks; i++)
+    {
+        thread_pool_submit(pool, &futures[i], &empty_task, NULL);
+        future_wait(pool, &futures[i]);
+    }
+    t2 = get_time_milliseconds();
+    printf("submit+wait from outside the pool: %8.1f ns/task\n", (t2 - t1) * 1e6 / n_tasks);
+
+    SpawnJob job = {pool, n_tasks - 1, futures + 1};
+    t1 = get_time_milliseconds();
+    thread_pool_submit(pool, &futures[0], &spawn_children_task, &job);
+    future_wait(pool, &futures[0]);
+    t2 = get_time_milliseconds();
+    printf("submit+wait from inside a worker:  %8.1f ns/task\n", (t2 - t1) * 1e6 / n_tasks);
+
+    t1 = get_time_milliseconds();
+    thread_pool_parallel_for(pool, 0, n_tasks, 1, &empty_range, NULL);
+    t2 = get_time_milliseconds();
+    printf("parallel_for with a grain of 1:    %8.1f ns/index\n", (t2 - t1) * 1e6 / n_tasks);
+
+    free(futures);
+}
+
+double bench_perft_with_workers(game_state* s, int depth, int n_workers, double baseline)
+{
+    ThreadPool pool;
+    thread_pool_create(&pool, n_workers, 1);
+    double t1 = get_time_milliseconds();
+    uint64_t n_leaves = parallel_perft(&pool, s, depth);
+    double t2 = get_time_milliseconds();
+    thread_pool_destroy(&pool);
+
+    if (baseline == 0)
+        baseline = t2 - t1;
+    printf("    %2d workers: %llu leaves in %8.1f ms, speedup %.2f\n",
+            n_workers, (unsigned long long) n_leaves, t2 - t1, baseline / (t2 - t1));
+    return t2 - t1;
+}
+
+void bench_scaling(int max_workers)
+{
+    game_state s = starting_state;
+    set_flags_new_state(&s);
+    const int depth = 4;
+
+    printf("perft(%d) of the starting position:\n", depth);
+    double baseline = bench_perft_with_workers(&s, depth, 1, 0);
+    int n_workers;
+    for (n_workers = 2; n_workers <= max_workers; n_workers *= 2)
+        bench_perft_with_workers(&s, depth, n_workers, baseline);
+    if (n_workers / 2 != max_workers && max_workers > 1)
+        bench_perft_with_workers(&s, depth, max_workers, baseline);
+}
+
+int random_positions(game_state* positions, int n)
+{
+    // positions from random games, each one made from the one before it
+    // unless a new game starts there
+    uint64_t rng = 0x9E3779B97F4A7C15ull;
+    Move moves[256];
+    game_state s = starting_state;
+    set_flags_new_state(&s);
+    int ply = 0;
+    for (int i = 0; i < n; i++)
+    {
+        positions[i] = s;
+        int n_moves = get_legal_moves_as_move_array(&s, moves);
+        if (n_moves == 0 || ++ply == 120)
+        {
+            s = starting_state;
+            set_flags_new_state(&s);
+            ply = 0;
+            continue;
+        }
+        rng ^= rng << 13;
+        rng ^= rng >> 7;
+        rng ^= rng << 17;
+        s = make_move_2(&s, moves[rng % n_moves]);
+    }
+    return n;
+}
+
+void bench_nnue(int n)
+{
+    game_state* positions = malloc(n * sizeof(game_state));
+    int* classical = malloc(n * sizeof(int));
+    int* network = malloc(n * sizeof(int));
+    random_positions(positions, n);
+    EVAL_PROFILE_CLEAR();
+
+    nnue_enabled = 0;
+    double t1 = get_time_milliseconds();
+    for (int i = 0; i < n; i++)
+        classical[i] = eval_comprehensive(&positions[i]);
+    double t2 = get_time_milliseconds();
+    printf("classical    %10.0f evals/s\n", n * 1000.0 / (t2 - t1));
+
+    nnue_enabled = 1;
+    nnue_clear_accumulators();
+    t1 = get_time_milliseconds();
+    for (int i = 0; i < n; i++)
+        network[i] = nnue_evaluate(&positions[i]);
+    t2 = get_time_milliseconds();
+    printf("nnue updated %10.0f evals/s, %s\n", n * 1000.0 / (t2 - t1), nnue_affine_name);
+
+    int n_mismatches = 0;
+    NnueAccumulator accumulator;
+    t1 = get_time_milliseconds();
+    for (int i = 0; i < n; i++)
+    {
+        nnue_refresh(&positions[i], accumulator.values[WHITE], WHITE);
+        nnue_refresh(&positions[i], accumulator.values[BLACK], BLACK);
+        n_mismatches += nnue_forward(&accumulator, positions[i].turn) != network[i];
+    }
+    t2 = get_time_milliseconds();
+    printf("nnue refresh %10.0f evals/s, %d differ from the updated ones\n", n * 1000.0 / (t2 - t1), n_mismatches);
+
+    // how close the network is to the classical eval
+    double sum_x = 0, sum_y = 0, sum_xx = 0, sum_yy = 0, sum_xy = 0, sum_difference = 0;
+    int same_sign = 0;
+    for (int i = 0; i < n; i++)
+    {
+        double x = classical[i], y = network[i];
+        sum_x += x;
+        sum_y += y;
+        sum_xx += x * x;
+        sum_yy += y * y;
+        sum_xy += x * y;
+        sum_difference += fabs(x - y);
+        same_sign += (x > 0) == (y > 0);
+    }
+    double covariance = sum_xy / n - (sum_x / n) * (sum_y / n);
+    double deviation_x = sqrt(sum_xx / n - (sum_x / n) * (sum_x / n));
+    double deviation_y = sqrt(sum_yy / n - (sum_y / n) * (sum_y / n));
+    printf("against the classical eval, on %d positions: mean difference %.1f cp, "
+            "correlation %.3f, same sign %.1f%%\n", n, sum_difference / n,
+            (deviation_x > 0 && deviation_y > 0) ? covariance / (deviation_x * deviation_y) : 0.0,
+            same_sign * 100.0 / n);
+    EVAL_PROFILE_PRINT(stdout);
+    free(positions);
+    free(classical);
+    free(network);
+}
+
+void bench_batch(int n)
+{
+    game_state* positions = malloc(n * sizeof(game_state));
+    Value* scalar = malloc(n * sizeof(Value));
+    Value* batch = malloc(n * sizeof(Value));
+    random_positions(positions, n);
+    EVAL_PROFILE_CLEAR();
+
+    double t1 = get_time_milliseconds();
+    for (int i = 0; i < n; i++)
+        scalar[i] = eval_comprehensive(&positions[i]);
+    double t2 = get_time_milliseconds();
+    double scalar_rate = n * 1000.0 / (t2 - t1);
+    printf("eval_comprehensive %10.0f evals/s\n", scalar_rate);
+
+    t1 = get_time_milliseconds();
+    evaluate_batch(positions, n, batch);
+    t2 = get_time_milliseconds();
+    int n_mismatches = 0;
+    for (int i = 0; i < n; i++)
+        n_mismatches += scalar[i] != batch[i];
+    printf("evaluate_batch     %10.0f evals/s, %s, %.1fx, %d of %d differ\n", n * 1000.0 / (t2 - t1),
+            eval_batch_name, n * 1000.0 / (t2 - t1) / scalar_rate, n_mismatches, n);
+    EVAL_PROFILE_PRINT(stdout);
+    free(positions);
+    free(scalar);
+    free(batch);
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc < 2)
+    {
+        fprintf(stderr, "Usage: %s threads [n_workers] | perft <depth> [fen] | search [limits] [fen <fen>] | mate [limits] [fen <fen>] | nnue <network> [n_positions] | batch [n_positions]\n", argv[0]);
+        return 1;
+    }
+
+    if (strcmp(argv[1], "threads") == 0)
+    {
+        int n_workers = (argc > 2) ? atoi(argv[2]) : thread_pool_default_n_workers();
+        ThreadPool pool;
+        thread_pool_create(&pool, n_workers, 0);
+        printf("%d workers\n", pool.n_workers);
+        bench_task_overhead(&pool);
+        thread_pool_destroy(&pool);
+        bench_scaling(n_workers);
+    } else if (strcmp(argv[1], "perft") == 0 && argc > 2) {
+        int depth = atoi(argv[2]);
+        game_state s = starting_state;
+        if (argc > 3)
+            read_state(&s, argv[3]);
+        set_flags_new_state(&s);
+
+        double t1 = get_time_milliseconds();
+        uint64_t n_leaves = perft(&s, depth);
+        double t2 = get_time_milliseconds();
+        printf("perft(%d) = %llu, serial   %8.1f ms\n", depth, (unsigned long long) n_leaves, t2 - t1);
+
+        ThreadPool pool;
+        thread_pool_create(&pool, 0, 0);
+        t1 = get_time_milliseconds();
+        n_leaves = parallel_perft(&pool, &s, depth);
+        t2 = get_time_milliseconds();
+        thread_pool_destroy(&pool);
+        printf("perft(%d) = %llu, parallel %8.1f ms on %d workers\n", depth, (unsigned long long) n_leaves, t2 - t1, pool.n_workers);
+    } else if (strcmp(argv[1], "search") == 0) {
+        SearchLimits limits;
+        char* fen = NULL;
+        parse_search_limits(argc - 2, argv + 2, &limits, &fen);
+        game_state s = starting_state;
+        if (fen != NULL)
+            read_state(&s, fen);
+        set_flags_new_state(&s);
+
+        Move move;
+        double search_time;
+        char uci[6];
+        if (book_probe(&s, &move))
+        {
+            move_to_uci(move, uci);
+            fprintf(stderr, "bestmove %s, from the book\n", uci);
+            return 0;
+        }
+        search_stats_output = stdout;
+        ThreadPool mcts_pool;
+        if (search_function == &choose_best_move_mcts)
+        {
+            thread_pool_create(&mcts_pool, mcts_n_threads, 0);
+            mcts_options.pool = &mcts_pool;
+        }
+        search_function(&s, &limits, &move, &search_time);
+        move_to_uci(move, uci);
+        fprintf(stderr, "bestmove %s, %llu nodes in %.1f ms\n", uci, (unsigned long long) n_states_explored, search_time);
+        if (search_function == &choose_best_move_mcts)
+        {
+            fprintf(stderr, "%llu playouts on %d threads, %.0f playouts/s\n",
+                    (unsigned long long) mcts_stats.playouts, mcts_stats.n_threads,
+                    (search_time > 0) ? mcts_stats.playouts * 1000.0 / search_time : 0.0);
+            thread_pool_destroy(&mcts_pool);
+            mcts_free();
+        }
+
+        // the lines of the last finished depth
+        if (search_stats.n_depths > 0 && limits.multipv > 1)
+        {
+            SearchDepthStats* d = &search_stats.depths[search_stats.n_depths - 1];
+            for (int i = 0; i < d->n_lines; i++)
+            {
+                fprintf(stderr, "%2d. depth %d value %6d nodes %8llu pv", i + 1, d->depth,
+                        d->lines[i].value, (unsigned long long) d->lines[i].nodes);
+                for (int j = 0; j < d->lines[i].length; j++)
+                {
+                    move_to_uci(d->lines[i].moves[j], uci);
+                    fprintf(stderr, " %s", uci);
+                }
+                fprintf(stderr, "\n");
+            }
+        }
+    } else if (strcmp(argv[1], "mate") == 0) {
+        SearchLimits limits;
+        char* fen = NULL;
+        parse_search_limits(argc - 2, argv + 2, &limits, &fen);
+        game_state s = starting_state;
+        if (fen != NULL)
+            read_state(&s, fen);
+        set_flags_new_state(&s);
+
+        MateSolution solution;
+        int result = solve_mate(&s, limits.mate, limits.nodes, limits.movetime, &solution);
+        if (result == 1)
+        {
+            printf("mate in %d:", (solution.n_plies + 1) / 2);
+            char uci[6];
+            for (int i = 0; i < solution.line_length; i++)
+            {
+                move_to_uci(solution.line[i], uci);
+                printf(" %s", uci);
+            }
+            printf("\n");
+        } else if (result == 0) {
+            printf("no mate%s\n", limits.mate ? " in that many moves" : "");
+        } else {
+            printf("gave up\n");
+        }
+        printf("%llu nodes in %.1f ms, %.0f nodes/s\n", (unsigned long long) solution.nodes,
+                solution.time_milliseconds,
+                (solution.time_milliseconds > 0) ? solution.nodes * 1000.0 / solution.time_milliseconds : 0.0);
+        mate_solver_free();
+    } else if (strcmp(argv[1], "batch") == 0) {
+        bench_batch((argc > 2) ? atoi(argv[2]) : 1000000);
+    } else if (strcmp(argv[1], "nnue") == 0 && argc > 2) {
+        if (nnue_init(argv[2]) == -1)
+            return 1;
+        bench_nnue((argc > 3) ? atoi(argv[3]) : 100000);
+        nnue_free();
+    } else {
+        fprintf(stderr, "Unknown benchmark %s\n", argv[1]);
+        return 1;
+    }
+    return 0;
+}
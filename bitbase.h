@@ -0,0 +1,130 @@
+#ifndef BITBASE_H_
+#define BITBASE_H_
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "board.h"
+#include "legal_moves.h"
+#include "tablebase.h"
+
+/*
+ * Bitbases for the endings where one side has only its king left
+ *
+ * A bitbase is one bit per position of a table: set if the stronger side
+ * wins, clear if it doesn't. With a bare king the weaker side can never
+ * win, so the bit is the whole result, at an eighth of the size of the
+ * table. The files (KPvK.cbb and so on) are written by tbgen next to the
+ * tables, indexed the same way, and are small enough that bitbase_init
+ * maps them all up front
+ *
+ * The eval and the search both ask them, see eval_comprehensive and
+ * minimax_eval_alpha_beta_pruning
+ */
+
+#define BITBASE_MAGIC 0x31424243 // "CBB1"
+
+typedef struct
+{
+    Tablebase tb;
+    const uint8_t* bits;
+    size_t mapped_size;
+} Bitbase;
+
+// the endings the bitbases are made for
+const char* bitbase_names[] = {"KQvK", "KRvK", "KPvK", "KBNvK"};
+#define N_BITBASES 4
+
+Bitbase bitbases[N_BITBASES];
+int n_bitbases = 0;
+
+int bitbase_load(const char* path, const char* name, Bitbase* bb)
+{
+    // returns 1 if `path`/`name`.cbb is there and looks right
+    memset(bb, 0, sizeof(Bitbase));
+    if (tb_parse_name(name, &bb->tb) == -1)
+        return 0;
+    char file_name[1024 + 32];
+    snprintf(file_name, sizeof(file_name), "%s/%s.cbb", path, name);
+    int fd = open(file_name, O_RDONLY);
+    if (fd == -1)
+        return 0;
+    struct stat st;
+    int ret = 0;
+    if (fstat(fd, &st) == 0 && (uint64_t) st.st_size == sizeof(TBHeader) + (bb->tb.n_positions + 7) / 8)
+    {
+        void* map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        const TBHeader* header = (const TBHeader*) map;
+        if (map != MAP_FAILED && header->magic == BITBASE_MAGIC && header->n_pieces == bb->tb.n_pieces
+                && memcmp(header->pieces, bb->tb.pieces, bb->tb.n_pieces) == 0)
+        {
+            bb->bits = (const uint8_t*) map + sizeof(TBHeader);
+            bb->mapped_size = st.st_size;
+            ret = 1;
+        } else if (map != MAP_FAILED) {
+            munmap(map, st.st_size);
+        }
+    }
+    close(fd);
+    return ret;
+}
+
+int bitbase_init(const char* path)
+{
+    // maps the bitbases in `path`, returns how many there were
+    tb_init_king_slots();
+    n_bitbases = 0;
+    for (int i = 0; i < N_BITBASES; i++)
+        if (bitbase_load(path, bitbase_names[i], &bitbases[n_bitbases]))
+            n_bitbases++;
+    return n_bitbases;
+}
+
+void bitbase_free()
+{
+    for (int i = 0; i < n_bitbases; i++)
+        munmap((void*) (bitbases[i].bits - sizeof(TBHeader)), bitbases[i].mapped_size);
+    n_bitbases = 0;
+}
+
+int bitbase_probe(game_state* s, int* wdl)
+{
+    /*
+     * looks `s` up in the bitbases
+     *
+     * returns 1 and sets `wdl` (from enum TB_WDL) for the side to move
+     *         0 if no bitbase covers `s`
+     */
+    if (n_bitbases == 0 || tb_can_castle(s) || s->en_passant != -1)
+        return 0;
+    if (popcount(s->white_pieces | s->black_pieces) > TB_MAX_PIECES)
+        return 0;
+
+    char name[2 * TB_MAX_PIECES + 2];
+    int flip = tb_signature(s, name);
+    for (int i = 0; i < n_bitbases; i++)
+    {
+        Bitbase* bb = &bitbases[i];
+        if (strcmp(bb->tb.name, name) != 0)
+            continue;
+        int squares[TB_MAX_PIECES];
+        if (!tb_squares_for_table(&bb->tb, s, flip, squares))
+            return 0;
+        // the stronger side plays white in the bitbase
+        int turn = flip ? get_opponent(s->turn) : s->turn;
+        uint64_t index = tb_index(&bb->tb, squares, turn);
+        int stronger_side_wins = (bb->bits[index / 8] >> (index % 8)) & 1;
+        if (!stronger_side_wins)
+            *wdl = TB_DRAW;
+        else
+            *wdl = (turn == WHITE) ? TB_WIN : TB_LOSS;
+        return 1;
+    }
+    return 0;
+}
+
+#endif // BITBASE_H_
@@ -5,6 +5,16 @@
 
 typedef struct game_state game_state;
 
+// castling changes the most squares, four
+#define MAX_SQUARE_CHANGES 4
+
+typedef struct
+{
+    int8_t square;
+    int8_t removed;
+    int8_t added;
+} SquareChange;
+
 struct game_state
 {
     /*
@@ -24,6 +34,22 @@ struct game_state
      *        stores binary state of whether at this point the rooks has been stationary or moved.
      *        index 0 for WHITE 1 for BLACK following enum turn convention
      *        and second index indicates whether it is left(0th index) or right rook(1th index)     
+     *   5. hash
+     *        the zobrist hash of the state, see zobrist.h
+     *        set by set_flags_new_state and kept up to date by make_move_2
+     *   6. pawn_hash
+     *        the zobrist hash of just the pawns, kept like hash, it indexes
+     *        the pawn table the pawn structure term is cached in, see pawn_table.h
+     *   7. material, piece_squares
+     *        the sums of piece_material and piece_square_values over the board,
+     *        middlegame and endgame values packed as Scores, see piece_square.h,
+     *        kept up to date by make_move_2
+     *   8. phase
+     *        the sum of piece_phase over the board, PHASE_MAX at the start
+     *   9. previous_hash, changes
+     *        the hash of the state the last move was made from and the squares
+     *        it changed, so the NNUE accumulator can be updated from that
+     *        state's, see nnue.h. n_changes is -1 when they aren't known
      * Things we might store in the future
      *   1. Check status
      *        Which kings are in check, which pieces check the opponent's king
@@ -37,6 +63,14 @@ struct game_state
     uint64_t white_pieces;
     uint8_t turn : 2;
     uint8_t castles_possible : 4;
+    uint64_t hash;
+    uint64_t pawn_hash;
+    int32_t material;
+    int32_t piece_squares;
+    uint8_t phase;
+    uint64_t previous_hash;
+    int8_t n_changes;
+    SquareChange changes[MAX_SQUARE_CHANGES];
 };
 
 enum MOVEMENT {
@@ -119,8 +153,9 @@ int is_pawn(int p)
 }
 
 // use this when you need the starting state
+// the bitboards, the hashes and the sums are left to set_flags_new_state
 const game_state starting_state = {
-    {
+    .squares = {
         B_ROOK, B_KNIGHT, B_BISHOP, B_QUEEN, B_KING, B_BISHOP, B_KNIGHT, B_ROOK,
         B_PAWN, B_PAWN,   B_PAWN,   B_PAWN,  B_PAWN, B_PAWN,   B_PAWN,   B_PAWN,
         BLANK,  BLANK,    BLANK,    BLANK,   BLANK,  BLANK,    BLANK,    BLANK,
@@ -130,11 +165,14 @@ const game_state starting_state = {
         W_PAWN, W_PAWN,   W_PAWN,   W_PAWN,  W_PAWN, W_PAWN,   W_PAWN,   W_PAWN,
         W_ROOK, W_KNIGHT, W_BISHOP, W_QUEEN, W_KING, W_BISHOP, W_KNIGHT, W_ROOK
     },
-    -1,
-    0,
-    0,
-    WHITE,
-    0b1111,
+    .en_passant = -1,
+    .black_pieces = 0,
+    .white_pieces = 0,
+    .turn = WHITE,
+    .castles_possible = 0b1111,
+    .hash = 0,
+    .pawn_hash = 0,
+    .n_changes = -1,
 };
 
 
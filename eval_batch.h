@@ -0,0 +1,298 @@
+#ifndef EVAL_BATCH_H_
+#define EVAL_BATCH_H_
+#include <stdint.h>
+#include <string.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+#include "board.h"
+#include "bitutils.h"
+#include "evaluation.h"
+
+/*
+ * Evaluates arrays of positions at once, for scoring datasets and batches
+ * of leaves, with the same result as eval_comprehensive on each
+ *
+ * Positions are taken EVAL_BATCH_LANES at a time and laid out as a
+ * structure of arrays, one lane per position: the material and space sums
+ * make_move_2 keeps, the material with the pawn structure from the pawn
+ * table added, the phase, the empty squares, and every knight and
+ * diagonal mover (see piece_mobility) as a slot of its own, holding the
+ * piece's square as a bitboard, its side's pieces and its row of
+ * piece_mobility_values. A lane runs out of pieces before the others
+ * with empty slots, which count nothing
+ *
+ * With AVX2, a slot is done for all four lanes at once, one 64 bit lane
+ * of a register each: the knights' moves are shifts of their bitboard,
+ * the diagonals are filled with Kogge-Stone occluded fills up to the first
+ * piece in the way, the squares are counted with the nibble lookup
+ * popcount, and their values gathered from piece_mobility_values. Then
+ * the four evals are blended at once. Without AVX2, or with a network
+ * loaded, it's eval_comprehensive on each position
+ */
+
+#define EVAL_BATCH_LANES 4
+// no side has more than 15 pieces besides the king
+#define EVAL_BATCH_SLOTS 30
+
+typedef struct
+{
+    int32_t material_mg[EVAL_BATCH_LANES];
+    int32_t material_eg[EVAL_BATCH_LANES];
+    int32_t space_mg[EVAL_BATCH_LANES];
+    int32_t space_eg[EVAL_BATCH_LANES];
+    int32_t phase[EVAL_BATCH_LANES];
+    // what the bitbases add, and whether they know it's a draw
+    int32_t known_win[EVAL_BATCH_LANES];
+    int32_t is_draw[EVAL_BATCH_LANES];
+    uint64_t empty[EVAL_BATCH_LANES];
+
+    int n_knights;
+    int n_sliders;
+    uint64_t knights[EVAL_BATCH_SLOTS][EVAL_BATCH_LANES];
+    uint64_t knight_own[EVAL_BATCH_SLOTS][EVAL_BATCH_LANES];
+    int64_t knight_rows[EVAL_BATCH_SLOTS][EVAL_BATCH_LANES];
+    uint64_t sliders[EVAL_BATCH_SLOTS][EVAL_BATCH_LANES];
+    uint64_t slider_own[EVAL_BATCH_SLOTS][EVAL_BATCH_LANES];
+    int64_t slider_rows[EVAL_BATCH_SLOTS][EVAL_BATCH_LANES];
+} EvalBatch;
+
+void eval_batch_clear_slots(EvalBatch* b, int n_knights, int n_sliders)
+{
+    // empties the first slots, BLANK's row of piece_mobility_values is all 0
+    for (int slot = 0; slot < n_knights; slot++)
+    {
+        for (int lane = 0; lane < EVAL_BATCH_LANES; lane++)
+        {
+            b->knights[slot][lane] = b->knight_own[slot][lane] = 0;
+            b->knight_rows[slot][lane] = BLANK * MOBILITY_COUNTS;
+        }
+    }
+    for (int slot = 0; slot < n_sliders; slot++)
+    {
+        for (int lane = 0; lane < EVAL_BATCH_LANES; lane++)
+        {
+            b->sliders[slot][lane] = b->slider_own[slot][lane] = 0;
+            b->slider_rows[slot][lane] = BLANK * MOBILITY_COUNTS;
+        }
+    }
+}
+
+void eval_batch_init(EvalBatch* b)
+{
+    eval_batch_clear_slots(b, EVAL_BATCH_SLOTS, EVAL_BATCH_SLOTS);
+    b->n_knights = b->n_sliders = 0;
+}
+
+void eval_batch_load(EvalBatch* b, const game_state* states, int n)
+{
+    // lays out up to EVAL_BATCH_LANES states, the lanes past n are empty
+    // boards. Only the slots the states before used need emptying
+    eval_batch_clear_slots(b, b->n_knights, b->n_sliders);
+    b->n_knights = b->n_sliders = 0;
+    for (int lane = 0; lane < EVAL_BATCH_LANES; lane++)
+    {
+        b->material_mg[lane] = b->material_eg[lane] = b->space_mg[lane] = b->space_eg[lane] = 0;
+        b->phase[lane] = b->known_win[lane] = b->is_draw[lane] = 0;
+        b->empty[lane] = ~0ULL;
+        if (lane >= n)
+            continue;
+        game_state* s = (game_state*) &states[lane];
+        int wdl;
+        if (bitbase_probe(s, &wdl))
+        {
+            b->is_draw[lane] = (wdl == TB_DRAW);
+            b->known_win[lane] = ((wdl == TB_WIN) == (s->turn == WHITE)) ? BITBASE_WIN_VALUE : -BITBASE_WIN_VALUE;
+        }
+        Score material = s->material + eval_pawn_structure(s);
+        b->material_mg[lane] = mg_value(material);
+        b->material_eg[lane] = eg_value(material);
+        b->space_mg[lane] = mg_value(s->piece_squares);
+        b->space_eg[lane] = eg_value(s->piece_squares);
+        b->phase[lane] = game_phase(s);
+        b->empty[lane] = ~(s->white_pieces | s->black_pieces);
+
+        int n_knights = 0, n_sliders = 0;
+        uint64_t pieces = s->white_pieces | s->black_pieces;
+        while (pieces)
+        {
+            int i = pop_lsb(&pieces);
+            int piece = s->squares[i];
+            if (is_pawn(piece) || is_king(piece))
+                continue;
+            uint64_t own = (get_player(piece) == WHITE) ? s->white_pieces : s->black_pieces;
+            if (is_knight(piece))
+            {
+                b->knights[n_knights][lane] = 1ULL << i;
+                b->knight_own[n_knights][lane] = own;
+                b->knight_rows[n_knights++][lane] = piece * MOBILITY_COUNTS;
+            } else {
+                b->sliders[n_sliders][lane] = 1ULL << i;
+                b->slider_own[n_sliders][lane] = own;
+                b->slider_rows[n_sliders++][lane] = piece * MOBILITY_COUNTS;
+            }
+        }
+        b->n_knights = (n_knights > b->n_knights) ? n_knights : b->n_knights;
+        b->n_sliders = (n_sliders > b->n_sliders) ? n_sliders : b->n_sliders;
+    }
+}
+
+void evaluate_batch_scalar(const game_state* states, int n, Value* out)
+{
+    for (int i = 0; i < n; i++)
+        out[i] = eval_comprehensive((game_state*) &states[i]);
+}
+
+#if defined(__x86_64__)
+// the squares a step can land on without wrapping around the board: not on
+// the a file (bit 0 of every row) after a step towards h, and so on
+#define EVAL_BATCH_NOT_A_FILE 0xFEFEFEFEFEFEFEFEULL
+#define EVAL_BATCH_NOT_H_FILE 0x7F7F7F7F7F7F7F7FULL
+
+__attribute__((target("avx2")))
+__m256i eval_batch_shift_avx2(__m256i x, int shift)
+{
+    // shifts each lane towards the higher squares for a positive shift
+    return (shift > 0) ? _mm256_sll_epi64(x, _mm_cvtsi32_si128(shift)) : _mm256_srl_epi64(x, _mm_cvtsi32_si128(-shift));
+}
+
+__attribute__((target("avx2")))
+__m256i eval_batch_fill_avx2(__m256i pieces, __m256i empty, int shift, __m256i mask)
+{
+    // the squares the pieces reach in the direction of `shift`,
+    // up to and with the first square that isn't empty
+    empty = _mm256_and_si256(empty, mask);
+    pieces = _mm256_or_si256(pieces, _mm256_and_si256(empty, eval_batch_shift_avx2(pieces, shift)));
+    empty = _mm256_and_si256(empty, eval_batch_shift_avx2(empty, shift));
+    pieces = _mm256_or_si256(pieces, _mm256_and_si256(empty, eval_batch_shift_avx2(pieces, 2 * shift)));
+    empty = _mm256_and_si256(empty, eval_batch_shift_avx2(empty, 2 * shift));
+    pieces = _mm256_or_si256(pieces, _mm256_and_si256(empty, eval_batch_shift_avx2(pieces, 4 * shift)));
+    return _mm256_and_si256(eval_batch_shift_avx2(pieces, shift), mask);
+}
+
+__attribute__((target("avx2")))
+__m256i eval_batch_popcount_avx2(__m256i x)
+{
+    // the set bits of each 64 bit lane, by looking up the nibbles
+    const __m256i table = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+                                           0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+    const __m256i low_nibbles = _mm256_set1_epi8(0x0F);
+    __m256i low = _mm256_shuffle_epi8(table, _mm256_and_si256(x, low_nibbles));
+    __m256i high = _mm256_shuffle_epi8(table, _mm256_and_si256(_mm256_srli_epi16(x, 4), low_nibbles));
+    return _mm256_sad_epu8(_mm256_add_epi8(low, high), _mm256_setzero_si256());
+}
+
+__attribute__((target("avx2")))
+__m128i eval_batch_mobility_avx2(const EvalBatch* b)
+{
+    // the mobility of the four lanes, in EVAL_FIXED_ONE units like eval_major_pieces_mobility
+    const __m256i not_a = _mm256_set1_epi64x(EVAL_BATCH_NOT_A_FILE);
+    const __m256i not_h = _mm256_set1_epi64x(EVAL_BATCH_NOT_H_FILE);
+    const __m256i not_ab = _mm256_set1_epi64x(0xFCFCFCFCFCFCFCFCULL);
+    const __m256i not_gh = _mm256_set1_epi64x(0x3F3F3F3F3F3F3F3FULL);
+    const __m256i empty = _mm256_loadu_si256((const __m256i*) b->empty);
+    __m128i mobility = _mm_setzero_si128();
+
+    for (int slot = 0; slot < b->n_knights; slot++)
+    {
+        __m256i knights = _mm256_loadu_si256((const __m256i*) b->knights[slot]);
+        __m256i one = _mm256_or_si256(_mm256_and_si256(_mm256_slli_epi64(knights, 1), not_a),
+                                      _mm256_and_si256(_mm256_srli_epi64(knights, 1), not_h));
+        __m256i two = _mm256_or_si256(_mm256_and_si256(_mm256_slli_epi64(knights, 2), not_ab),
+                                      _mm256_and_si256(_mm256_srli_epi64(knights, 2), not_gh));
+        __m256i moves = _mm256_or_si256(_mm256_or_si256(_mm256_slli_epi64(one, 16), _mm256_srli_epi64(one, 16)),
+                                        _mm256_or_si256(_mm256_slli_epi64(two, 8), _mm256_srli_epi64(two, 8)));
+        moves = _mm256_andnot_si256(_mm256_loadu_si256((const __m256i*) b->knight_own[slot]), moves);
+        __m256i index = _mm256_add_epi64(_mm256_loadu_si256((const __m256i*) b->knight_rows[slot]),
+                                         eval_batch_popcount_avx2(moves));
+        mobility = _mm_add_epi32(mobility, _mm256_i64gather_epi32((const int*) piece_mobility_values, index, 4));
+    }
+
+    for (int slot = 0; slot < b->n_sliders; slot++)
+    {
+        __m256i sliders = _mm256_loadu_si256((const __m256i*) b->sliders[slot]);
+        // towards h the a file can't be reached, towards a the h file
+        __m256i moves = _mm256_or_si256(
+            _mm256_or_si256(eval_batch_fill_avx2(sliders, empty, 9, not_a), eval_batch_fill_avx2(sliders, empty, -7, not_a)),
+            _mm256_or_si256(eval_batch_fill_avx2(sliders, empty, 7, not_h), eval_batch_fill_avx2(sliders, empty, -9, not_h)));
+        moves = _mm256_andnot_si256(_mm256_loadu_si256((const __m256i*) b->slider_own[slot]), moves);
+        __m256i index = _mm256_add_epi64(_mm256_loadu_si256((const __m256i*) b->slider_rows[slot]),
+                                         eval_batch_popcount_avx2(moves));
+        mobility = _mm_add_epi32(mobility, _mm256_i64gather_epi32((const int*) piece_mobility_values, index, 4));
+    }
+    return mobility;
+}
+
+__attribute__((target("avx2")))
+void evaluate_batch_avx2(const game_state* states, int n, Value* out)
+{
+    // the blend of eval_comprehensive with the terms regrouped: the material
+    // and space parts blended in int32, the mobility with its blended weight
+    // in int64, the same sum in the end
+    EvalBatch b;
+    eval_batch_init(&b);
+    const __m128i mg_mobility_weight = _mm_set1_epi32(MG_MOBILITY_WEIGHT_FIXED);
+    const __m128i eg_mobility_weight = _mm_set1_epi32(EG_MOBILITY_WEIGHT_FIXED);
+    const __m128i phase_max = _mm_set1_epi32(PHASE_MAX);
+    for (int first = 0; first < n; first += EVAL_BATCH_LANES)
+    {
+        int n_lanes = (n - first < EVAL_BATCH_LANES) ? n - first : EVAL_BATCH_LANES;
+        eval_batch_load(&b, &states[first], n_lanes);
+        __m128i mobility = eval_batch_mobility_avx2(&b);
+
+        __m128i phase = _mm_loadu_si128((const __m128i*) b.phase);
+        __m128i other_phase = _mm_sub_epi32(phase_max, phase);
+        __m128i middlegame = _mm_add_epi32(
+            _mm_mullo_epi32(_mm_set1_epi32(MATERIAL_WEIGHT_FIXED), _mm_loadu_si128((const __m128i*) b.material_mg)),
+            _mm_mullo_epi32(_mm_set1_epi32(SPACE_WEIGHT_FIXED), _mm_loadu_si128((const __m128i*) b.space_mg)));
+        __m128i endgame = _mm_add_epi32(
+            _mm_mullo_epi32(_mm_set1_epi32(MATERIAL_WEIGHT_FIXED), _mm_loadu_si128((const __m128i*) b.material_eg)),
+            _mm_mullo_epi32(_mm_set1_epi32(SPACE_WEIGHT_FIXED), _mm_loadu_si128((const __m128i*) b.space_eg)));
+        __m128i blended = _mm_add_epi32(_mm_mullo_epi32(middlegame, phase), _mm_mullo_epi32(endgame, other_phase));
+        __m128i mobility_weight = _mm_add_epi32(_mm_mullo_epi32(mg_mobility_weight, phase),
+                                                _mm_mullo_epi32(eg_mobility_weight, other_phase));
+
+        // widened to int64: blended * EVAL_FIXED_ONE + mobility * its weight, times 100
+        __m256i sum = _mm256_mul_epi32(_mm256_cvtepi32_epi64(blended), _mm256_set1_epi64x(EVAL_FIXED_ONE));
+        sum = _mm256_add_epi64(sum, _mm256_mul_epi32(_mm256_cvtepi32_epi64(mobility), _mm256_cvtepi32_epi64(mobility_weight)));
+        // 64 + 32 + 4, there's no 64 bit multiply
+        sum = _mm256_add_epi64(_mm256_add_epi64(_mm256_slli_epi64(sum, 6), _mm256_slli_epi64(sum, 5)), _mm256_slli_epi64(sum, 2));
+        int64_t sums[EVAL_BATCH_LANES];
+        _mm256_storeu_si256((__m256i*) sums, sum);
+        for (int lane = 0; lane < n_lanes; lane++)
+            out[first + lane] = b.is_draw[lane] ? 0 : (Value) (clamp_eval(divide_rounded(sums[lane], EVAL_BLEND_UNITS)) + b.known_win[lane]);
+    }
+}
+#endif
+
+typedef void (*EvalBatchFunction)(const game_state* states, int n, Value* out);
+
+EvalBatchFunction eval_batch_function = NULL;
+const char* eval_batch_name = "scalar";
+
+void eval_batch_select()
+{
+    eval_batch_function = &evaluate_batch_scalar;
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+    {
+        eval_batch_function = &evaluate_batch_avx2;
+        eval_batch_name = "avx2";
+    }
+#endif
+}
+
+void evaluate_batch(const game_state* states, int n, Value* out)
+{
+    // out[i] = eval_comprehensive(&states[i]) for the n states
+    if (eval_batch_function == NULL)
+        eval_batch_select();
+    if (nnue_enabled)
+        evaluate_batch_scalar(states, n, out);
+    else
+        eval_batch_function(states, n, out);
+}
+
+#endif // EVAL_BATCH_H_
@@ -0,0 +1,64 @@
+#ifndef EVAL_CACHE_H_
+#define EVAL_CACHE_H_
+#include <stdint.h>
+#include <stdatomic.h>
+
+#include "board.h"
+#include "evaluation.h"
+#include "search_stats.h"
+
+/*
+ * A direct-mapped cache of static evaluations, indexed by the low bits of
+ * the zobrist hash of a game_state
+ *
+ * Each entry is a single 64 bit word: the evaluation in the low 16 bits
+ * and the high 48 bits of the hash in the rest, so an entry is read and
+ * written in one go and the cache needs no locks, even with several
+ * threads searching. A torn or overwritten entry just fails the check
+ * on the hash bits and gets evaluated again
+ */
+
+// has to be a power of two, 2^18 entries is 2MB
+#define EVAL_CACHE_SIZE (1 << 18)
+#define EVAL_CACHE_VALUE_MASK 0xFFFFULL
+
+atomic_uint_fast64_t eval_cache[EVAL_CACHE_SIZE];
+
+void eval_cache_clear()
+{
+    for (int i = 0; i < EVAL_CACHE_SIZE; i++)
+        atomic_store_explicit(&eval_cache[i], 0, memory_order_relaxed);
+}
+
+Value eval_cached_lazily(game_state* s, Value alpha, Value beta)
+{
+    // evaluate_lazily, but each state is only evaluated once. The evals that
+    // stopped early only hold for this window, so they aren't kept
+    atomic_uint_fast64_t* entry = &eval_cache[s->hash & (EVAL_CACHE_SIZE - 1)];
+    uint64_t data = atomic_load_explicit(entry, memory_order_relaxed);
+    search_counters.eval_cache_probes++;
+    if (((data ^ s->hash) & ~EVAL_CACHE_VALUE_MASK) == 0)
+    {
+        search_counters.eval_cache_hits++;
+        return (Value) (uint16_t) (data & EVAL_CACHE_VALUE_MASK);
+    }
+
+    int exact;
+    Value value = evaluate_lazily(s, alpha, beta, &exact);
+    if (!exact)
+    {
+        search_counters.lazy_evals++;
+        return value;
+    }
+    data = (s->hash & ~EVAL_CACHE_VALUE_MASK) | (uint16_t) value;
+    atomic_store_explicit(entry, data, memory_order_relaxed);
+    return value;
+}
+
+Value eval_cached(game_state* s)
+{
+    // eval_comprehensive, but each state is only evaluated once
+    return eval_cached_lazily(s, INT16_MIN, INT16_MAX);
+}
+
+#endif // EVAL_CACHE_H_
@@ -0,0 +1,156 @@
+#ifndef EVAL_PROFILE_H_
+#define EVAL_PROFILE_H_
+#include <stdio.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+/*
+ * Where the time of the evaluation goes, in a build with -DEVAL_PROFILE
+ *
+ * Every call of the eval and of each of its terms is counted and timed
+ * with the time stamp counter (rdtsc), split by what the search wanted
+ * the eval for: the leaves of the main search, the stand pat of the
+ * quiescence search, the static eval of the nodes near the frontier or
+ * ordering the moves by the evals they lead to. Anything else, like MCTS
+ * or the benchmarks, counts as other. The evals the eval cache already had
+ * aren't timed, and the total includes what the terms leave out, the
+ * blend and the profiling itself
+ *
+ * A search clears the counts when it starts and prints the table to stderr
+ * when it's done, the benchmarks that evaluate print it at their end.
+ * The counts are atomic, so the MCTS threads can share them
+ *
+ * Without -DEVAL_PROFILE the macros are empty, and nothing of this is
+ * compiled into the eval or the search
+ */
+
+enum EVAL_PROFILE_TERMS {
+    EP_TOTAL, EP_BITBASE, EP_NNUE, EP_MATERIAL, EP_PAWNS, EP_SPACE, EP_MOBILITY, EP_N_TERMS
+};
+
+enum EVAL_PROFILE_PHASES {
+    EP_OTHER, EP_LEAF, EP_QUIESCENCE, EP_FRONTIER, EP_ORDERING, EP_N_PHASES
+};
+
+const char* eval_profile_term_names[EP_N_TERMS] = {"total", "bitbase", "nnue", "material", "pawns", "space", "mobility"};
+const char* eval_profile_phase_names[EP_N_PHASES] = {"other", "leaf", "quiescence", "frontier", "ordering"};
+
+typedef struct
+{
+    atomic_ullong calls;
+    atomic_ullong cycles;
+} EvalProfileEntry;
+
+EvalProfileEntry eval_profile[EP_N_PHASES][EP_N_TERMS];
+// what the search is evaluating for on this thread
+_Thread_local int eval_profile_phase = EP_OTHER;
+
+uint64_t eval_profile_clock()
+{
+    // cycles where there's a time stamp counter, nanoseconds elsewhere
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (uint64_t) t.tv_sec * 1000000000ULL + t.tv_nsec;
+#endif
+}
+
+void eval_profile_add(int term, uint64_t start)
+{
+    EvalProfileEntry* entry = &eval_profile[eval_profile_phase][term];
+    atomic_fetch_add_explicit(&entry->cycles, eval_profile_clock() - start, memory_order_relaxed);
+    atomic_fetch_add_explicit(&entry->calls, 1, memory_order_relaxed);
+}
+
+int eval_profile_enter(int phase)
+{
+    eval_profile_phase = phase;
+    return 0;
+}
+
+int eval_profile_leave(int value)
+{
+    eval_profile_phase = EP_OTHER;
+    return value;
+}
+
+void eval_profile_clear()
+{
+    for (int phase = 0; phase < EP_N_PHASES; phase++)
+    {
+        for (int term = 0; term < EP_N_TERMS; term++)
+        {
+            atomic_store_explicit(&eval_profile[phase][term].calls, 0, memory_order_relaxed);
+            atomic_store_explicit(&eval_profile[phase][term].cycles, 0, memory_order_relaxed);
+        }
+    }
+}
+
+uint64_t eval_profile_overhead()
+{
+    // what reading the clock twice costs, the least of a few tries,
+    // it's taken off every timing in the table
+    uint64_t least = UINT64_MAX;
+    for (int i = 0; i < 1000; i++)
+    {
+        uint64_t start = eval_profile_clock();
+        uint64_t cycles = eval_profile_clock() - start;
+        least = (cycles < least) ? cycles : least;
+    }
+    return least;
+}
+
+void eval_profile_print(FILE* f)
+{
+    // one row per phase and term that was called, with the cycles per call
+    // and the share of all the time spent evaluating
+    uint64_t overhead = eval_profile_overhead();
+    uint64_t all_cycles = 0;
+    for (int phase = 0; phase < EP_N_PHASES; phase++)
+    {
+        uint64_t calls = atomic_load(&eval_profile[phase][EP_TOTAL].calls);
+        uint64_t cycles = atomic_load(&eval_profile[phase][EP_TOTAL].cycles);
+        all_cycles += (cycles > calls * overhead) ? cycles - calls * overhead : 0;
+    }
+    fprintf(f, "eval profile, %llu cycles of clock overhead taken off each call\n", (unsigned long long) overhead);
+    fprintf(f, "%-11s %-9s %12s %14s %10s %7s\n", "phase", "term", "calls", "cycles", "per call", "share");
+    for (int phase = 0; phase < EP_N_PHASES; phase++)
+    {
+        for (int term = 0; term < EP_N_TERMS; term++)
+        {
+            uint64_t calls = atomic_load(&eval_profile[phase][term].calls);
+            uint64_t cycles = atomic_load(&eval_profile[phase][term].cycles);
+            if (calls == 0)
+                continue;
+            cycles = (cycles > calls * overhead) ? cycles - calls * overhead : 0;
+            fprintf(f, "%-11s %-9s %12llu %14llu %10.1f %6.1f%%\n", eval_profile_phase_names[phase],
+                    eval_profile_term_names[term], (unsigned long long) calls, (unsigned long long) cycles,
+                    (double) cycles / calls, all_cycles ? cycles * 100.0 / all_cycles : 0.0);
+        }
+    }
+    fflush(f);
+}
+
+#ifdef EVAL_PROFILE
+// times what follows up to EVAL_PROFILE_END in the same block
+#define EVAL_PROFILE_START(name) uint64_t name = eval_profile_clock()
+#define EVAL_PROFILE_END(term, name) eval_profile_add((term), (name))
+// evaluates `call`, an eval, counting it under `phase`
+#define EVAL_IN_PHASE(phase, call) (eval_profile_enter(phase), eval_profile_leave(call))
+#define EVAL_PROFILE_CLEAR() eval_profile_clear()
+#define EVAL_PROFILE_PRINT(f) eval_profile_print(f)
+#else
+#define EVAL_PROFILE_START(name)
+#define EVAL_PROFILE_END(term, name)
+#define EVAL_IN_PHASE(phase, call) (call)
+#define EVAL_PROFILE_CLEAR()
+#define EVAL_PROFILE_PRINT(f)
+#endif
+
+#endif // EVAL_PROFILE_H_
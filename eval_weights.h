@@ -0,0 +1,41 @@
+#ifndef EVAL_WEIGHTS_H_
+#define EVAL_WEIGHTS_H_
+
+/*
+ * The weights of the classical evaluation, see piece_square.h and evaluation.h
+ *
+ * The hand-picked ones. tune.out writes this file over with weights fitted
+ * to the results of real games, see tuner.h
+ */
+
+#define MATERIAL_PAWN   SCORE(10, 20)
+#define MATERIAL_KNIGHT SCORE(60, 50)
+#define MATERIAL_BISHOP SCORE(60, 65)
+#define MATERIAL_ROOK   SCORE(100, 110)
+#define MATERIAL_QUEEN  SCORE(500, 500)
+
+#define PAWN_SPACE_ROW_1 SCORE(2, 4)
+#define PAWN_SPACE_ROW_2 SCORE(3, 6)
+#define PAWN_SPACE_ROW_3 SCORE(4, 8)
+#define PAWN_SPACE_ROW_4 SCORE(5, 10)
+#define PAWN_SPACE_ROW_5 SCORE(6, 12)
+#define PAWN_SPACE_ROW_6 SCORE(7, 14)
+
+#define PASSED_PAWN_ROW_1 SCORE(0, 1)
+#define PASSED_PAWN_ROW_2 SCORE(1, 2)
+#define PASSED_PAWN_ROW_3 SCORE(2, 4)
+#define PASSED_PAWN_ROW_4 SCORE(4, 8)
+#define PASSED_PAWN_ROW_5 SCORE(7, 14)
+#define PASSED_PAWN_ROW_6 SCORE(11, 22)
+#define ISOLATED_PAWN SCORE(-2, -3)
+#define DOUBLED_PAWN SCORE(-2, -4)
+
+#define KNIGHT_MOB_VAL 0.875
+#define BISHOP_MOB_VAL 1.149
+#define ROOK_MOB_VAL 1.17
+#define QUEEN_MOB_VAL 1.093
+
+#define MG_MOBILITY_WEIGHT 0.2
+#define EG_MOBILITY_WEIGHT 0.15
+
+#endif // EVAL_WEIGHTS_H_
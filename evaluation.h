@@ -4,18 +4,125 @@
 #include <math.h>
 #include "board.h"
 #include "legal_moves.h"
+#include "pawn_table.h"
+#include "bitbase.h"
+#include "nnue.h"
+#include "eval_profile.h"
+// KNIGHT_MOB_VAL and the others, and the mobility weights, see tuner.h
+#include "eval_weights.h"
 
-#define KNIGHT_MOB_VAL 0.875
-#define BISHOP_MOB_VAL 1.149
-#define ROOK_MOB_VAL 1.17
-#define QUEEN_MOB_VAL 1.093
+// how the terms are weighed against each other in eval_comprehensive, the
+// material and space terms have their own middlegame and endgame values,
+// the pawn structure is weighed like the material,
+// mobility only gets a different weight, MG_MOBILITY_WEIGHT and
+// EG_MOBILITY_WEIGHT. The mobility of the sliders grows exponentially, and
+// with the board emptying it would run away. The material and space weights
+// set the scale of the eval, so the tuner keeps them and tunes the values
+#define MATERIAL_WEIGHT 0.75
+#define SPACE_WEIGHT 0.05
 
-float power(float a,int n){
-    float result=1;
-    for(int i=1;i<=n;i++){
-        result *=a;
-    }
-    return result;
+// the blend in eval_comprehensive puts a pawn at the middlegame value of
+// MATERIAL_PAWN times MATERIAL_WEIGHT, 10 * 0.75, this scales it back so
+// that a pawn is worth 100 centipawns
+#define EVAL_UNITS_PER_PAWN 7.5
+#define CENTIPAWNS_PER_EVAL_UNIT (100.0/EVAL_UNITS_PER_PAWN)
+
+// the eval adds up in fixed point, EVAL_FIXED_ONE to an eval unit, so nothing
+// on its path is a float. The weights and the mobility tables are rounded to
+// that when the program is compiled, which keeps the eval within a centipawn
+// of adding up the weights in float, it's only off where that lands within
+// a hair of half a centipawn
+#define EVAL_FIXED_ONE 4096
+#define EVAL_FIXED(x) ((int32_t) ((x) * EVAL_FIXED_ONE + (((x) < 0) ? -0.5 : 0.5)))
+
+// a pawn in the units of the blend in evaluate_terms_lazily, EVAL_FIXED_ONE
+// squared and PHASE_MAX times over
+#define EVAL_BLEND_UNITS ((int64_t) EVAL_FIXED(EVAL_UNITS_PER_PAWN) * EVAL_FIXED_ONE * PHASE_MAX)
+
+#define MATERIAL_WEIGHT_FIXED EVAL_FIXED(MATERIAL_WEIGHT)
+#define SPACE_WEIGHT_FIXED EVAL_FIXED(SPACE_WEIGHT)
+#define MG_MOBILITY_WEIGHT_FIXED EVAL_FIXED(MG_MOBILITY_WEIGHT)
+#define EG_MOBILITY_WEIGHT_FIXED EVAL_FIXED(EG_MOBILITY_WEIGHT)
+
+// piece_mobility counts at most 8 squares for a knight and 13 for the others
+#define MOBILITY_COUNTS 14
+
+// the tuner keeps the sliders' bases, the knight's value per square and
+// the mobility weights below these. A slider with all 13 squares is worth
+// 1.25^13, about 18.2 eval units, the knight at most 8 * 1.25, so fifteen
+// pieces' mobility stays under 15 * 18.2 * 0.5 units, 20 pawns either way
+// (see LAZY_EVAL_MARGIN), far from what a Value or the fixed point can hold
+#define MOBILITY_BASE_MAX 1.25
+#define MOBILITY_WEIGHT_MAX 0.5
+
+// a^n for a constant n below 16, by squaring, as a constant expression
+#define MOBILITY_POWER(a, n) \
+    ((((n) & 1) ? (a) : 1.0) * (((n) & 2) ? (a) * (a) : 1.0) * \
+     (((n) & 4) ? (a) * (a) * (a) * (a) : 1.0) * \
+     (((n) & 8) ? (a) * (a) * (a) * (a) * (a) * (a) * (a) * (a) : 1.0))
+
+// the mobility of a knight is a linear function of the squares it can go
+// to, the sliders' is exponential
+#define KNIGHT_MOBILITY(n) EVAL_FIXED(KNIGHT_MOB_VAL * (n))
+#define BISHOP_MOBILITY(n) EVAL_FIXED(MOBILITY_POWER(BISHOP_MOB_VAL, n))
+#define ROOK_MOBILITY(n) EVAL_FIXED(MOBILITY_POWER(ROOK_MOB_VAL, n))
+#define QUEEN_MOBILITY(n) EVAL_FIXED(MOBILITY_POWER(QUEEN_MOB_VAL, n))
+#define MOBILITY_4(f, n) f(n), f((n)+1), f((n)+2), f((n)+3)
+#define MOBILITY_14(f) MOBILITY_4(f, 0), MOBILITY_4(f, 4), MOBILITY_4(f, 8), f(12), f(13)
+#define NEGATED(f) -f
+
+// what the mobility of a piece is worth for the number of squares it has,
+// in EVAL_FIXED_ONE units, indexed like piece_material, negative for black
+const int32_t piece_mobility_values[14][MOBILITY_COUNTS] = {
+    [W_KNIGHT] = {MOBILITY_14(KNIGHT_MOBILITY)},
+    [W_BISHOP] = {MOBILITY_14(BISHOP_MOBILITY)},
+    [W_ROOK] = {MOBILITY_14(ROOK_MOBILITY)},
+    [W_QUEEN] = {MOBILITY_14(QUEEN_MOBILITY)},
+    [B_KNIGHT] = {MOBILITY_14(NEGATED(KNIGHT_MOBILITY))},
+    [B_BISHOP] = {MOBILITY_14(NEGATED(BISHOP_MOBILITY))},
+    [B_ROOK] = {MOBILITY_14(NEGATED(ROOK_MOBILITY))},
+    [B_QUEEN] = {MOBILITY_14(NEGATED(QUEEN_MOBILITY))},
+};
+
+// the most a single piece's mobility can be worth either way. The sliders'
+// mobility is at its largest with all 13 squares if its base is above 1,
+// with none (1.0) otherwise
+#define MAX_OF(a, b) (((a) > (b)) ? (a) : (b))
+#define ABS_OF(a) (((a) < 0) ? -(a) : (a))
+#define PIECE_MOBILITY_BOUND \
+    MAX_OF(MAX_OF(ABS_OF(KNIGHT_MOBILITY(8)), ABS_OF(BISHOP_MOBILITY(13))), \
+           MAX_OF(MAX_OF(ABS_OF(ROOK_MOBILITY(13)), ABS_OF(QUEEN_MOBILITY(13))), EVAL_FIXED(1.0)))
+
+// how far the mobility term can move the eval, in centipawns: neither side
+// has more than 15 pieces besides the king, the blend of the middlegame and
+// endgame weights is at most the bigger one, and one more for the rounding
+#define LAZY_EVAL_MARGIN \
+    ((int) ((15LL * PIECE_MOBILITY_BOUND * MAX_OF(ABS_OF(MG_MOBILITY_WEIGHT_FIXED), ABS_OF(EG_MOBILITY_WEIGHT_FIXED)) * 100 \
+             + EVAL_BLEND_UNITS / PHASE_MAX - 1) / (EVAL_BLEND_UNITS / PHASE_MAX)) + 1)
+
+// evaluations and search scores are centipawns from white's point of view
+typedef int16_t Value;
+
+// promotions can put more material on the board than a Value holds, the
+// classical eval is clamped to this either way, the bitbases' known win
+// comes on top of that and the two together stay under TB_WIN_VALUE
+#define EVAL_MAX_VALUE 15000
+
+// what a win the bitbases know of is worth on top of the eval, the eval
+// then tells the search how to make progress towards the mate. No eval
+// outside the bitbases is worth more
+#define BITBASE_WIN_VALUE EVAL_MAX_VALUE
+
+int64_t divide_rounded(int64_t a, int64_t b)
+{
+    // a / b to the nearest integer, halves away from zero, b has to be positive
+    return (a >= 0) ? (a + b / 2) / b : -((-a + b / 2) / b);
+}
+
+int64_t clamp_eval(int64_t value)
+{
+    // to within EVAL_MAX_VALUE either way
+    return (value > EVAL_MAX_VALUE) ? EVAL_MAX_VALUE : (value < -EVAL_MAX_VALUE) ? -EVAL_MAX_VALUE : value;
 }
 
 float eval_random(game_state* s)
@@ -24,98 +131,180 @@ float eval_random(game_state* s)
     return x;
 }
 
-const float Piece_Value[14] = {100.0,60.0,60.0,900.0,500.0,10.0,0.0,0.0,-100.0,-60.0,-60.0,-900.0,-500.0,-10.0};
-float eval_space_coverage(game_state *s){
-    float space_covered=0.0;
-    float space;
-    for(int i=0;i<64;i++){
-        int piece = s->squares[i];
-        if(piece==W_PAWN ||piece==B_PAWN){//white  pawn
-            space =(float)board_index_to_coord_y(i);
-            space_covered = (piece==W_PAWN)? space_covered+space+1.0:space_covered-8.0+space;
-        }
-    }
-    return space_covered;
+Score eval_space_coverage(game_state *s){
+    // how far the pawns have advanced, kept up to date by make_move_2
+    return s->piece_squares;
+}
+
+int piece_mobility(game_state* s, int square)
+{
+    // the number of squares the knight, bishop, rook or queen on `square`
+    // counts in eval_major_pieces_mobility, the tuner counts them the same way
+    if (is_knight(s->squares[square]))
+        return popcount(legal_move_knight(s, square));
+    return popcount(legal_move_bishop(s, square));
 }
 
 //only for major pieces like bishop, queen, rook, knight
-float eval_major_pieces_mobility(game_state *s){
-    float mobility=0.0;
-    uint64_t possible_moves;
-    int count;
-    for(int i=0;i<64;i++){
-        int piece =s->squares[i];
-        if(!is_blank(piece)){
-            switch (piece){
-                case B_KNIGHT:
-                case W_KNIGHT:
-                    possible_moves =legal_move_knight(s,i);
-                    count = popcount(possible_moves);
-                    if(get_player(piece)==WHITE){
-                        mobility += KNIGHT_MOB_VAL*count; //mobility for knight is linear function of places available
-                    }
-                    else{
-                        mobility -= KNIGHT_MOB_VAL*count;
-                    }
-                    break;
-                case B_BISHOP:
-                case W_BISHOP:
-                    possible_moves =legal_move_bishop(s,i);
-                    count = popcount(possible_moves);
-                    if(get_player(piece)==WHITE){
-                        mobility += power(BISHOP_MOB_VAL,count);//mobility for bishop is exp func of places
-                    }
-                    else{
-                        mobility -= power(BISHOP_MOB_VAL,count);
-                    }
-                    break;
-                case W_ROOK:
-                case B_ROOK:
-                    possible_moves =legal_move_bishop(s,i);
-                    count = popcount(possible_moves);
-                    if(get_player(piece)==WHITE){
-                        mobility += power(ROOK_MOB_VAL,count);//mobility for rook too is exp func of places
-                    }
-                    else{
-                        mobility -= power(ROOK_MOB_VAL,count);
-                    }
-                    break;
-                case W_QUEEN:
-                case B_QUEEN:
-                    possible_moves =legal_move_bishop(s,i);
-                    count = popcount(possible_moves);
-                    if(get_player(piece)==WHITE){
-                        mobility += power(QUEEN_MOB_VAL,count);//mobility of queen is also kept as exp. function
-                    }
-                    else{
-                        mobility -= power(QUEEN_MOB_VAL,count);
-                    }
-                    break;
-            }
-        }
+MULTIVERSIONED
+int32_t eval_major_pieces_mobility(game_state *s){
+    // in EVAL_FIXED_ONE units, see piece_mobility_values
+    int32_t mobility=0;
+    uint64_t pieces = s->white_pieces | s->black_pieces;
+    while (pieces)
+    {
+        int i = pop_lsb(&pieces);
+        int piece = s->squares[i];
+        if (is_pawn(piece) || is_king(piece))
+            continue;
+        mobility += piece_mobility_values[piece][piece_mobility(s,i)];
     }
     return mobility;
 }
 
-float eval_material(game_state *s)
+Score eval_material(game_state *s)
+{
+    // kept up to date by make_move_2, see piece_square.h
+    return s->material;
+}
+
+Score eval_pawn_structure(game_state* s)
 {
-    float evaluation = 0.0;
-    for (int i = 0; i < 64; i++)
+    // the passed, isolated and doubled pawns, see pawn_table.h
+    return probe_pawn_table(s)->score;
+}
+
+int game_phase(game_state* s)
+{
+    // PHASE_MAX for the middlegame down to 0 for the endgame, promotions can
+    // put more pieces on the board than the start had
+    return (s->phase < PHASE_MAX) ? s->phase : PHASE_MAX;
+}
+
+void check_piece_square_sums(game_state* s)
+{
+    // build with -DDEBUG_EVAL to check the sums, bitboards and hashes
+    // make_move_2 keeps against adding up the board at every evaluation
+#ifdef DEBUG_EVAL
+    game_state full = *s;
+    set_bitboards_and_hashes(&full);
+    if (full.hash != s->hash || full.pawn_hash != s->pawn_hash
+        || full.white_pieces != s->white_pieces || full.black_pieces != s->black_pieces)
+    {
+        fprintf(stderr, "hashes or bitboards are off: hash %016llx, should be %016llx, "
+                "pawn hash %016llx, should be %016llx\n",
+                (unsigned long long) s->hash, (unsigned long long) full.hash,
+                (unsigned long long) s->pawn_hash, (unsigned long long) full.pawn_hash);
+        abort();
+    }
+    Score material, piece_squares;
+    uint8_t phase;
+    set_piece_square_sums(s, &material, &piece_squares, &phase);
+    if (material != s->material || piece_squares != s->piece_squares || phase != s->phase)
+    {
+        fprintf(stderr, "piece square sums are off: material %d/%d, should be %d/%d, "
+                "piece squares %d/%d, should be %d/%d, phase %d, should be %d\n",
+                mg_value(s->material), eg_value(s->material), mg_value(material), eg_value(material),
+                mg_value(s->piece_squares), eg_value(s->piece_squares), mg_value(piece_squares), eg_value(piece_squares),
+                s->phase, phase);
+        abort();
+    }
+#else
+    (void) s;
+#endif
+}
+Value evaluate_terms_lazily(game_state* s, Value alpha, Value beta, int* exact)
+{
+    /*
+     * The eval of the state, as far as it matters to a search with the window
+     * (alpha, beta), from white's point of view like the window
+     *
+     * The terms that make_move_2 keeps up to date are added up first. If they
+     * put the eval further outside the window than the mobility term could
+     * move it back, see LAZY_EVAL_MARGIN, that is returned without generating
+     * any moves, as the bound closest to the window the eval is known to be
+     * beyond. `exact` is set to 0 then, and to 1 if the eval is the full one
+     */
+    *exact = 1;
+    // the bitbases know the small endgames exactly
+    int wdl;
+    Value known_win = 0;
+    EVAL_PROFILE_START(bitbase_start);
+    int in_bitbase = bitbase_probe(s, &wdl);
+    EVAL_PROFILE_END(EP_BITBASE, bitbase_start);
+    if (in_bitbase)
+    {
+        if (wdl == TB_DRAW)
+            return 0;
+        known_win = ((wdl == TB_WIN) == (s->turn == WHITE)) ? BITBASE_WIN_VALUE : -BITBASE_WIN_VALUE;
+    }
+    if (nnue_enabled)
+    {
+        EVAL_PROFILE_START(nnue_start);
+        Value value = (Value) nnue_evaluate(s) + known_win;
+        EVAL_PROFILE_END(EP_NNUE, nnue_start);
+        return value;
+    }
+    check_piece_square_sums(s);
+    EVAL_PROFILE_START(material_start);
+    Score material=eval_material(s);
+    EVAL_PROFILE_END(EP_MATERIAL, material_start);
+    EVAL_PROFILE_START(pawns_start);
+    material += eval_pawn_structure(s);
+    EVAL_PROFILE_END(EP_PAWNS, pawns_start);
+    EVAL_PROFILE_START(space_start);
+    Score space_covered=eval_space_coverage(s);
+    EVAL_PROFILE_END(EP_SPACE, space_start);
+    // the middlegame and endgame evaluations, blended by how much material
+    // is left, in EVAL_FIXED_ONE squared units so that nothing is rounded
+    // until the end
+    int64_t middlegame = ((int64_t) MATERIAL_WEIGHT_FIXED*mg_value(material)+SPACE_WEIGHT_FIXED*mg_value(space_covered))*EVAL_FIXED_ONE;
+    int64_t endgame = ((int64_t) MATERIAL_WEIGHT_FIXED*eg_value(material)+SPACE_WEIGHT_FIXED*eg_value(space_covered))*EVAL_FIXED_ONE;
+    int phase = game_phase(s);
+
+    // the clamp keeps the order of the evals, so the bounds hold after it
+    int64_t lazy = divide_rounded((middlegame*phase + endgame*(PHASE_MAX - phase)) * 100, EVAL_BLEND_UNITS);
+    Value upper = (Value) (clamp_eval(lazy + LAZY_EVAL_MARGIN) + known_win);
+    if (upper <= alpha)
     {
-        int piece =s->squares[i];
-            //material addition
-            evaluation +=Piece_Value[piece];
+        *exact = 0;
+        return upper;
     }
-    return evaluation;
+    Value lower = (Value) (clamp_eval(lazy - LAZY_EVAL_MARGIN) + known_win);
+    if (lower >= beta)
+    {
+        *exact = 0;
+        return lower;
+    }
+
+    EVAL_PROFILE_START(mobility_start);
+    int64_t mobility=eval_major_pieces_mobility(s);
+    EVAL_PROFILE_END(EP_MOBILITY, mobility_start);
+    middlegame += MG_MOBILITY_WEIGHT_FIXED*mobility;
+    endgame += EG_MOBILITY_WEIGHT_FIXED*mobility;
+    return (Value) (clamp_eval(divide_rounded((middlegame*phase + endgame*(PHASE_MAX - phase)) * 100, EVAL_BLEND_UNITS)) + known_win);
 }
+
+Value evaluate_lazily(game_state* s, Value alpha, Value beta, int* exact)
+{
+    // see evaluate_terms_lazily, this is where a profiling build times the whole eval
+    EVAL_PROFILE_START(start);
+    Value value = evaluate_terms_lazily(s, alpha, beta, exact);
+    EVAL_PROFILE_END(EP_TOTAL, start);
+    return value;
+}
+
+Value evaluate(game_state* s, Value alpha, Value beta)
+{
+    // evaluate_lazily, for when it doesn't matter whether the eval is exact
+    int exact;
+    return evaluate_lazily(s, alpha, beta, &exact);
+}
+
 //main evaluation function
-float eval_comprehensive(game_state *s){
-    float evaluation=0.0;
-    float material=eval_material(s);
-    float mobility=eval_major_pieces_mobility(s);
-    float space_covered=eval_space_coverage(s);
-    evaluation = 0.75*material+0.05*space_covered+0.2*mobility;
-    return evaluation;
+Value eval_comprehensive(game_state *s){
+    // the full eval, no window is ever wide enough for it to stop early
+    return evaluate(s, INT16_MIN, INT16_MAX);
 }
 
 #endif
@@ -81,6 +81,10 @@ typedef struct
     int n_captured_white_pieces;
     int n_captured_black_pieces;
     uint8_t is_doge_mode;
+    uint8_t is_ponder_mode;
+    // set by the keyboard, main() hands them to the engine's search
+    uint8_t force_move_requested;
+    uint8_t cancel_search_requested;
 
 } UIState;
 
@@ -96,6 +100,9 @@ void construct_new_ui_state(UIState* s)
     s->is_check_mate_black = 0;
     s->stalemate = 0;
     s->is_doge_mode = 0;
+    s->is_ponder_mode = 1;
+    s->force_move_requested = 0;
+    s->cancel_search_requested = 0;
 
     for (int i = 0; i < 15; i++)
     {
@@ -345,11 +352,24 @@ void process_event(game_state* s, UIState* ui_s){
         ui_s->stop_main_loop = 1;
     else if(ui_s->event.type == SDL_MOUSEBUTTONUP && ui_s->event.button.button == SDL_BUTTON_LEFT)
     {
+        // the engine's pieces are off limits while it thinks
+        if (((s->turn == WHITE) ? ui_s->player_white : ui_s->player_black) == AI)
+            return;
         ui_s->mouse_x = ui_s->event.button.x;
         ui_s->mouse_y = ui_s->event.button.y;
         process_click(s, ui_s);
     } else if (ui_s->event.type == SDL_KEYUP && ui_s->event.key.keysym.sym == SDLK_w) {
         ui_s->is_doge_mode = 1 - ui_s->is_doge_mode;
+    } else if (ui_s->event.type == SDL_KEYUP && ui_s->event.key.keysym.sym == SDLK_p) {
+        // thinking on the opponent's time
+        ui_s->is_ponder_mode = 1 - ui_s->is_ponder_mode;
+        fprintf(stderr, "Pondering %s.\n", ui_s->is_ponder_mode ? "on" : "off");
+    } else if (ui_s->event.type == SDL_KEYUP && ui_s->event.key.keysym.sym == SDLK_SPACE) {
+        // play the best move found so far
+        ui_s->force_move_requested = 1;
+    } else if (ui_s->event.type == SDL_KEYUP && ui_s->event.key.keysym.sym == SDLK_ESCAPE) {
+        // stop the engine and take over its side
+        ui_s->cancel_search_requested = 1;
     }
 }
 
@@ -6,6 +6,8 @@
 #include <stdint.h>
 #include "bitutils.h"
 #include "board.h"
+#include "zobrist.h"
+#include "piece_square.h"
 
 enum DIRECTIONS {
     DIR_TOP, DIR_BOTTOM, DIR_LEFT, DIR_RIGHT,
@@ -97,6 +99,22 @@ int get_to_bits(uint32_t in)
     return in & 0b111111;
 }
 
+void move_to_uci(Move m, char* uci)
+{
+    // writes `m` in UCI notation (like e2e4 or e7e8q) to `uci`,
+    // which needs room for 6 characters
+    const char promotion_chars[] = {'q', 'r', 'b', 'n'};
+    int from = get_from_bits(m);
+    int to = get_to_bits(m);
+    int promotion = get_promotion_bits(m);
+    uci[0] = get_file_for_board_index(from);
+    uci[1] = get_rank_for_board_index(from);
+    uci[2] = get_file_for_board_index(to);
+    uci[3] = get_rank_for_board_index(to);
+    uci[4] = promotion ? promotion_chars[LOG2(promotion)] : '\0';
+    uci[5] = '\0';
+}
+
 void print_moves(uint64_t moves)
 {
     // prints the moves set in `moves` as an 8x8 grid with
@@ -565,24 +583,95 @@ uint64_t which_pieces_check_king(game_state *s, int king_index)
     return ret;
 }
 
-void set_flags_new_state(game_state* new)
+void set_bitboards_and_hashes(game_state* new)
 {
     new->white_pieces = 0;
     new->black_pieces = 0;
+    new->hash = zobrist_castles[new->castles_possible];
+    new->pawn_hash = zobrist_pawns_base;
+    if (new->turn == BLACK)
+        new->hash ^= zobrist_black_to_move;
+    if (new->en_passant != -1)
+        new->hash ^= zobrist_en_passant[(int) new->en_passant];
     for (int i = 0; i < 64; i++)
     {
         if (get_player(new->squares[i]) == BLACK)
             new->black_pieces = set_nth_bit_to(new->black_pieces, i, 1);
         if (get_player(new->squares[i]) == WHITE)
             new->white_pieces = set_nth_bit_to(new->white_pieces, i, 1);
+        if (!is_blank(new->squares[i]))
+            new->hash ^= zobrist_pieces[(int) new->squares[i]][i];
+        if (is_pawn(new->squares[i]))
+            new->pawn_hash ^= zobrist_pieces[(int) new->squares[i]][i];
+    }
+}
+
+void set_piece_square_sums(game_state* s, Score* material, Score* piece_squares, uint8_t* phase)
+{
+    // adds up the material, piece square values and phase of the whole board
+    *material = 0;
+    *piece_squares = 0;
+    *phase = 0;
+    for (int i = 0; i < 64; i++)
+    {
+        *material += piece_material[(int) s->squares[i]];
+        *piece_squares += piece_square_values[(int) s->squares[i]][i];
+        *phase += piece_phase[(int) s->squares[i]];
     }
 }
 
+void set_flags_new_state(game_state* new)
+{
+    // everything derived from the squares, from scratch
+    set_bitboards_and_hashes(new);
+    set_piece_square_sums(new, &new->material, &new->piece_squares, &new->phase);
+    new->n_changes = -1;
+}
+
+void start_changes(game_state* s, uint64_t previous_hash)
+{
+    // the squares set from here on are recorded as changed from the state hashed `previous_hash`
+    s->previous_hash = previous_hash;
+    s->n_changes = 0;
+}
+
+void set_square(game_state* s, int square, int piece)
+{
+    // puts `piece` on `square`, the sums, the bitboards and the piece keys
+    // of the hashes only change by the two pieces involved
+    int old = s->squares[square];
+    s->material += piece_material[piece] - piece_material[old];
+    s->piece_squares += piece_square_values[piece][square] - piece_square_values[old][square];
+    s->phase += piece_phase[piece] - piece_phase[old];
+    s->squares[square] = piece;
+
+    uint64_t bit = 1ULL << square;
+    s->white_pieces &= ~bit;
+    s->black_pieces &= ~bit;
+    if (get_player(piece) == WHITE)
+        s->white_pieces |= bit;
+    if (get_player(piece) == BLACK)
+        s->black_pieces |= bit;
+    if (!is_blank(old))
+        s->hash ^= zobrist_pieces[old][square];
+    if (!is_blank(piece))
+        s->hash ^= zobrist_pieces[piece][square];
+    if (is_pawn(old))
+        s->pawn_hash ^= zobrist_pieces[old][square];
+    if (is_pawn(piece))
+        s->pawn_hash ^= zobrist_pieces[piece][square];
+    if (s->n_changes >= 0 && s->n_changes < MAX_SQUARE_CHANGES)
+        s->changes[(int) s->n_changes++] = (SquareChange) {square, old, piece};
+    else
+        s->n_changes = -1;
+}
+
 game_state make_move_2(game_state* s, Move m)
 {
     // executes a move and returns the resulting game_state
 
     game_state ret = *s;
+    start_changes(&ret, s->hash);
     ret.turn = get_opponent(s->turn);
     int from = get_from_bits(m);
     int to = get_to_bits(m);
@@ -591,7 +680,7 @@ game_state make_move_2(game_state* s, Move m)
     if (is_pawn(s->squares[from]) && to == s->en_passant)
     {
         int captured_pawn_index = get_square_in_direction(to, pawn_move_vectors[get_opponent(s->turn)], 1);
-        ret.squares[captured_pawn_index] = BLANK;
+        set_square(&ret, captured_pawn_index, BLANK);
         ret.en_passant = -1;
     }
     if (is_pawn(s->squares[from]) && pawn_initial_ranks[get_player(s->squares[from])] == board_index_to_coord_y(from) &&
@@ -610,22 +699,23 @@ game_state make_move_2(game_state* s, Move m)
             && get_nth_bit(castles_possible, 0)
             && s->squares[get_last_square_in_direction(s, DIR_LEFT, from)] == own_rook)
         {
-            ret.squares[rook_translations_castle_to[s->turn==BLACK][0]] = ret.squares[rook_translations_castle_fr[s->turn==BLACK][0]];
-            ret.squares[rook_translations_castle_fr[s->turn==BLACK][0]] = BLANK;
+            set_square(&ret, rook_translations_castle_to[s->turn==BLACK][0], ret.squares[rook_translations_castle_fr[s->turn==BLACK][0]]);
+            set_square(&ret, rook_translations_castle_fr[s->turn==BLACK][0], BLANK);
         }
         if (to == king_translations_castle[s->turn==BLACK][1]
             && get_nth_bit(castles_possible, 1)
             && s->squares[get_last_square_in_direction(s, DIR_RIGHT, from)] == own_rook)
         {
-            ret.squares[rook_translations_castle_to[s->turn==BLACK][1]] = ret.squares[rook_translations_castle_fr[s->turn==BLACK][1]];
-            ret.squares[rook_translations_castle_fr[s->turn==BLACK][1]] = BLANK;
+            set_square(&ret, rook_translations_castle_to[s->turn==BLACK][1], ret.squares[rook_translations_castle_fr[s->turn==BLACK][1]]);
+            set_square(&ret, rook_translations_castle_fr[s->turn==BLACK][1], BLANK);
         }
         uint8_t reset_mask = (s->turn == WHITE) ? 0b1100 : 0b0011;
         ret.castles_possible = s->castles_possible & reset_mask;
     }
     if (is_rook(s->squares[from]))
     {
-        uint8_t reset_mask;
+        // a rook that isn't on its starting square takes no castle with it
+        uint8_t reset_mask = 0b1111;
         if (from == rook_translations_castle_fr[s->turn==BLACK][0])
         {
             reset_mask = (s->turn==WHITE) ? 0b1110 : 0b1011;
@@ -635,17 +725,23 @@ game_state make_move_2(game_state* s, Move m)
         }
         ret.castles_possible = ret.castles_possible & reset_mask;
     }
-    ret.squares[to] = s->squares[from];
-    ret.squares[from] = BLANK;
+    set_square(&ret, from, BLANK);
     if (promotions)
     {
         char what_to_promote_to = LOG2(promotions);
 
         what_to_promote_to = promotion_pieces[s->turn==BLACK][(int)what_to_promote_to];
 
-        ret.squares[to] = what_to_promote_to;
-    }
-    set_flags_new_state(&ret);
+        set_square(&ret, to, what_to_promote_to);
+    } else {
+        set_square(&ret, to, s->squares[from]);
+    }
+    // set_square kept the piece keys, the rest of the hash changes here
+    ret.hash ^= zobrist_black_to_move ^ zobrist_castles[s->castles_possible] ^ zobrist_castles[ret.castles_possible];
+    if (s->en_passant != -1)
+        ret.hash ^= zobrist_en_passant[(int) s->en_passant];
+    if (ret.en_passant != -1)
+        ret.hash ^= zobrist_en_passant[(int) ret.en_passant];
     return ret;
 }
 int find_piece(game_state* s, int piece)
@@ -666,6 +762,7 @@ int find_piece(game_state* s, int piece)
     return -1;
 }
 
+MULTIVERSIONED
 int ensure_moves_are_legal(game_state* s, Move move[], int n_moves)
 {
     // make sure none of the moves cause the player's own king
@@ -673,7 +770,8 @@ int ensure_moves_are_legal(game_state* s, Move move[], int n_moves)
 
     int king_index = -1;
 
-    Move legal_moves[n_moves];
+    // the legal moves are packed to the front in place,
+    // there are never more of them than moves looked at
     int n_legal_moves = 0;
     for (int i = 0; i < n_moves; i++)
     {
@@ -682,13 +780,11 @@ int ensure_moves_are_legal(game_state* s, Move move[], int n_moves)
         king_index = find_piece(&new_state, king_we_re_searching_for);
         if (!is_king_in_check(&new_state, king_index))
         {
-            legal_moves[n_legal_moves] = move[i];
+            move[n_legal_moves] = move[i];
             n_legal_moves++;
         }
     }
 
-    memcpy(move, legal_moves, n_legal_moves*sizeof(Move));
-
     return n_legal_moves;
 }
 
@@ -751,6 +847,7 @@ int get_legal_moves_from_one_square_as_move_array(game_state* s, int index, Move
     return counter;
 }
 
+MULTIVERSIONED
 int get_legal_moves_as_move_array(game_state* s, Move moves[])
 {
     int counter = 0, i;
@@ -787,6 +884,28 @@ int is_check_mate(game_state* s)
     return 0;
 }
 
+MULTIVERSIONED
+uint64_t perft(game_state* s, int depth)
+{
+    // counts the leaves of the move tree `depth` plies deep,
+    // the usual way to check (and time) a move generator
+    if (depth == 0)
+        return 1;
+
+    Move moves[256];
+    int n_moves = get_legal_moves_as_move_array(s, moves);
+    if (depth == 1)
+        return n_moves;
+
+    uint64_t n_leaves = 0;
+    for (int i = 0; i < n_moves; i++)
+    {
+        game_state new_state = make_move_2(s, moves[i]);
+        n_leaves += perft(&new_state, depth - 1);
+    }
+    return n_leaves;
+}
+
 int is_move_legal(uint64_t possible_moves, int to)
 {
     return get_nth_bit(possible_moves, to);
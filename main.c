@@ -10,9 +10,54 @@
 #include "legal_moves.h"
 #include "gui.h"
 #include "ai.h"
+#include "opening_book.h"
+#include "mcts.h"
 #include "evaluation.h"
 
 UIState ui_state;
+ThreadPool engine_pool;
+// the workers of the MCTS searcher, they all search the same tree
+ThreadPool mcts_pool;
+PonderState ponder_state;
+AsyncSearch ai_search;
+
+void play_ai_move(game_state* s, Move move)
+{
+    ui_state.move = move;
+    ui_state.from = get_from_bits(move);
+    ui_state.to = get_from_bits(move);
+    process_move(s, &ui_state);
+    int opponent = (s->turn == WHITE) ? ui_state.player_white : ui_state.player_black;
+    if (ui_state.is_ponder_mode && opponent == HUMAN)
+        start_pondering(&ponder_state, s);
+}
+
+void on_ai_search_done(AsyncSearch* a, void* arg)
+{
+    // runs in the main loop, from async_search_poll
+    game_state* s = (game_state*) arg;
+    if (a->ret == -1)
+        return;
+    play_ai_move(s, a->move);
+}
+
+void think_if_ai_to_move(game_state* s, const SearchLimits* limits)
+{
+    // starts the engine's search when it's the engine's turn,
+    // the book moves are played right away
+    if (ui_state.is_check_mate_black || ui_state.is_check_mate_white || ui_state.stalemate)
+        return;
+    if (ai_search.active || ((s->turn == WHITE) ? ui_state.player_white : ui_state.player_black) != AI)
+        return;
+    Move move;
+    if (book_probe(s, &move))
+    {
+        stop_pondering(&ponder_state);
+        play_ai_move(s, move);
+        return;
+    }
+    async_search_start(&ai_search, s, limits, &on_ai_search_done, s);
+}
 
 int main(int argc, char *argv[])
 {
@@ -25,14 +70,52 @@ int main(int argc, char *argv[])
 
     set_flags_new_state(&current_state);
 
+    // append the statistics of every search to this file, as JSON lines
+    char* stats_file_name = getenv("CHESS_SEARCH_STATS");
+    if (stats_file_name != NULL)
+        search_stats_output = fopen(stats_file_name, "a");
+
+    // the endgame tablebases and bitbases written by tbgen.out
+    char* tablebase_path = getenv("CHESS_TABLEBASE_PATH");
+    if (tablebase_path != NULL && tb_init(tablebase_path) == -1)
+        fprintf(stderr, "Can't read the tablebases in %s\n", tablebase_path);
+    if (tablebase_path != NULL)
+        bitbase_init(tablebase_path);
+
+    // a Polyglot opening book
+    char* book_file_name = getenv("CHESS_BOOK");
+    if (book_file_name != NULL)
+        book_init(book_file_name);
+
+    // an NNUE network file to evaluate with instead of the classical eval
+    char* nnue_file_name = getenv("CHESS_NNUE");
+    if (nnue_file_name != NULL)
+        nnue_init(nnue_file_name);
+
+    // CHESS_SEARCHER=mcts plays with the Monte-Carlo tree search on every core instead
+    char* searcher = getenv("CHESS_SEARCHER");
+    int use_mcts = searcher != NULL && strcmp(searcher, "mcts") == 0;
+    if (use_mcts)
+    {
+        thread_pool_create(&mcts_pool, thread_pool_default_n_workers(), 0);
+        mcts_options.pool = &mcts_pool;
+        search_function = &choose_best_move_mcts;
+    }
+
     select_game_mode(&ui_state);
 
     construct_new_ui_state(&ui_state);
     init_graphics(&ui_state);
     read_assets(&ui_state);
 
-    double search_time;
+    SearchLimits limits = search_limits_for_depth(SEARCH_DEPTH);
 
+    thread_pool_create(&engine_pool, 1, 0);
+    construct_new_ponder_state(&ponder_state, &engine_pool);
+    construct_new_async_search(&ai_search, &engine_pool, &ponder_state);
+
+    // the engine thinks on the pool, the loop keeps drawing and
+    // handling events at its frame rate meanwhile
     while (!(ui_state.stop_main_loop))
     {
         while (SDL_PollEvent(&(ui_state.event)))
@@ -40,32 +123,46 @@ int main(int argc, char *argv[])
             process_event(&current_state, &ui_state);
         }
 
-        render_game(&current_state, &ui_state);
-        SDL_RenderPresent(ui_state.renderer);
-
-        if (!(ui_state.is_check_mate_black || ui_state.is_check_mate_white || ui_state.stalemate))
+        if (ui_state.force_move_requested)
         {
-            if (current_state.turn == WHITE && ui_state.player_white == AI)
-            {
-                int ret = choose_best_move(&current_state, &(ui_state.move), &search_time);
-                if (ret == -1)
-                    continue;
-                ui_state.from = get_from_bits(ui_state.move);
-                ui_state.to = get_from_bits(ui_state.move);
-                process_move(&current_state, &ui_state);
-            }
-            if (current_state.turn == BLACK && ui_state.player_black == AI)
+            ui_state.force_move_requested = 0;
+            async_search_stop(&ai_search);
+        }
+        if (ui_state.cancel_search_requested)
+        {
+            ui_state.cancel_search_requested = 0;
+            if (ai_search.active)
             {
-                int ret = choose_best_move(&current_state, &(ui_state.move), &search_time);
-                if (ret == -1)
-                    continue;
-                ui_state.from = get_from_bits(ui_state.move);
-                ui_state.to = get_from_bits(ui_state.move);
-                process_move(&current_state, &ui_state);
+                async_search_cancel(&ai_search);
+                if (current_state.turn == WHITE)
+                    ui_state.player_white = HUMAN;
+                else
+                    ui_state.player_black = HUMAN;
+                fprintf(stderr, "Search cancelled, your move.\n");
             }
         }
+
+        async_search_poll(&ai_search);
+        think_if_ai_to_move(&current_state, &limits);
+
+        render_game(&current_state, &ui_state);
+        SDL_RenderPresent(ui_state.renderer);
         SDL_Delay(33);
     }
+    async_search_cancel(&ai_search);
+    stop_pondering(&ponder_state);
+    thread_pool_destroy(&engine_pool);
+    if (use_mcts)
+    {
+        thread_pool_destroy(&mcts_pool);
+        mcts_free();
+    }
+    tb_free();
+    bitbase_free();
+    book_free();
+    nnue_free();
+    if (search_stats_output != NULL)
+        fclose(search_stats_output);
     cleanup(&current_state, &ui_state);
     return 0;
 }
@@ -0,0 +1,367 @@
+#ifndef MATE_SOLVER_H_
+#define MATE_SOLVER_H_
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "board.h"
+#include "legal_moves.h"
+#include "ai.h"
+
+/*
+ * A mate solver, depth-first proof-number search (df-pn)
+ *
+ * Alpha-beta looks at every move to a fixed depth. Proof-number search
+ * instead keeps, for every node, how many leaves still have to be proven
+ * to show the attacker mates (the proof number, pn) and how many to show
+ * it doesn't (the disproof number, dn), and always expands the leaf that
+ * is cheapest to settle. Forcing lines get searched very deep, and the
+ * many defences that are already lost don't cost much
+ *
+ * The attacker is the side to move at the root. At its nodes (OR nodes)
+ * one mating move is enough: pn is the smallest pn of the children and dn
+ * their sum. At the defender's nodes (AND nodes) every move has to lose,
+ * so it's the other way around. df-pn walks the tree depth first under
+ * thresholds on pn and dn, and keeps the numbers in its own transposition
+ * table, which has a fixed size: when it's full, the entries that took
+ * the least work to find are the ones that go
+ *
+ * The number of plies left is part of the key, so a node only counts as
+ * proven if the mate fits in what's left, and the search can't go around
+ * in circles. Without a target the solver looks for a mate in 1, then in 2
+ * and so on, keeping the table, which is still right for the plies left at
+ * each node, so the first mate it finds is the shortest
+ */
+
+// entries in the table, has to be a power of two, 2^21 entries is 48MB
+#define DFPN_TT_SIZE (1 << 21)
+#define DFPN_INFINITY 100000000u
+#define DFPN_NODES_BETWEEN_CLOCK_CHECKS 4096
+// the longest mate it looks for, so the plies fit on the stack
+#define DFPN_MAX_MATE (MAX_PLY / 2)
+
+typedef struct
+{
+    uint64_t key;
+    uint32_t pn;
+    uint32_t dn;
+    // the nodes it took to get these numbers, decides what gets replaced
+    uint32_t work;
+    // for a proven node, the plies to the mate along the line found
+    uint16_t mate_plies;
+} DfpnEntry;
+
+typedef struct
+{
+    Move moves[MAX_MOVES];
+    uint64_t keys[MAX_MOVES];
+} DfpnStackEntry;
+
+typedef struct
+{
+    /*
+     * result  1 if a mate was found
+     *         0 if there is none (in n moves, with a target)
+     *        -1 if the solver ran out of nodes or time first
+     */
+    int result;
+    int n_plies;
+    int line_length;
+    Move line[MAX_PLY];
+    uint64_t nodes;
+    double time_milliseconds;
+} MateSolution;
+
+DfpnEntry* dfpn_table = NULL;
+DfpnStackEntry dfpn_stack[MAX_PLY];
+
+int dfpn_attacker;
+uint64_t dfpn_nodes;
+uint64_t dfpn_max_nodes;
+double dfpn_deadline;
+int dfpn_nodes_until_clock_check;
+int dfpn_aborted;
+
+uint64_t dfpn_key(uint64_t hash, int remaining)
+{
+    return hash ^ ((uint64_t) (remaining + 1) * 0x9E3779B97F4A7C15ull);
+}
+
+uint32_t dfpn_add(uint32_t a, uint32_t b)
+{
+    // only a child that is settled makes a sum infinite, a big sum stays just below
+    if (a >= DFPN_INFINITY || b >= DFPN_INFINITY)
+        return DFPN_INFINITY;
+    uint64_t sum = (uint64_t) a + b;
+    return (sum >= DFPN_INFINITY) ? DFPN_INFINITY - 1 : (uint32_t) sum;
+}
+
+int dfpn_lookup(uint64_t key, uint32_t* pn, uint32_t* dn, uint16_t* mate_plies)
+{
+    // the table is split in buckets of two entries, an empty entry has pn = dn = 0
+    DfpnEntry* bucket = &dfpn_table[key & (DFPN_TT_SIZE - 2)];
+    for (int i = 0; i < 2; i++)
+    {
+        if (bucket[i].key == key && (bucket[i].pn || bucket[i].dn))
+        {
+            *pn = bucket[i].pn;
+            *dn = bucket[i].dn;
+            *mate_plies = bucket[i].mate_plies;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+void dfpn_store(uint64_t key, uint32_t pn, uint32_t dn, uint64_t work, uint16_t mate_plies)
+{
+    DfpnEntry* bucket = &dfpn_table[key & (DFPN_TT_SIZE - 2)];
+    DfpnEntry* entry = (bucket[0].work <= bucket[1].work) ? &bucket[0] : &bucket[1];
+    for (int i = 0; i < 2; i++)
+        if (bucket[i].key == key)
+            entry = &bucket[i];
+    entry->key = key;
+    entry->pn = pn;
+    entry->dn = dn;
+    entry->work = (work > UINT32_MAX) ? UINT32_MAX : (uint32_t) work;
+    entry->mate_plies = mate_plies;
+}
+
+int dfpn_should_stop()
+{
+    if (dfpn_aborted)
+        return 1;
+    if (atomic_load_explicit(&search_stop, memory_order_relaxed)
+            || (dfpn_max_nodes && dfpn_nodes >= dfpn_max_nodes))
+        dfpn_aborted = 1;
+    if (dfpn_deadline && --dfpn_nodes_until_clock_check <= 0)
+    {
+        dfpn_nodes_until_clock_check = DFPN_NODES_BETWEEN_CLOCK_CHECKS;
+        if (get_time_milliseconds() >= dfpn_deadline)
+            dfpn_aborted = 1;
+    }
+    return dfpn_aborted;
+}
+
+uint32_t dfpn_threshold_above(uint32_t second_best)
+{
+    // the 1+epsilon trick: let the best child run until it's a quarter
+    // worse than the second best, instead of just worse, so df-pn doesn't
+    // keep switching between two children that are about as good
+    if (second_best >= DFPN_INFINITY)
+        return DFPN_INFINITY;
+    return dfpn_add(second_best, second_best / 4 + 1);
+}
+
+void dfpn_child_numbers(DfpnStackEntry* st, int i, uint32_t* pn, uint32_t* dn, uint16_t* mate_plies)
+{
+    // a child that hasn't been searched yet is a single leaf
+    *mate_plies = 0;
+    if (!dfpn_lookup(st->keys[i], pn, dn, mate_plies))
+    {
+        *pn = 1;
+        *dn = 1;
+    }
+}
+
+void dfpn_mid(game_state* s, int ply, int remaining, uint32_t pn_threshold, uint32_t dn_threshold)
+{
+    // searches below `s` until its pn or dn reaches its threshold, and stores them
+    dfpn_nodes++;
+    uint64_t nodes_before = dfpn_nodes;
+    uint64_t key = dfpn_key(s->hash, remaining);
+    int or_node = (s->turn == dfpn_attacker);
+    DfpnStackEntry* st = &dfpn_stack[ply];
+
+    int n_moves = get_legal_moves_as_move_array(s, st->moves);
+    if (n_moves == 0 || remaining == 0)
+    {
+        // only the defender getting mated proves anything,
+        // stalemates and running out of plies disprove
+        if (n_moves == 0 && !or_node && is_side_to_move_in_check(s))
+            dfpn_store(key, 0, DFPN_INFINITY, 1, 0);
+        else
+            dfpn_store(key, DFPN_INFINITY, 0, 1, 0);
+        return;
+    }
+    for (int i = 0; i < n_moves; i++)
+    {
+        game_state child = make_move_2(s, st->moves[i]);
+        st->keys[i] = dfpn_key(child.hash, remaining - 1);
+    }
+
+    uint32_t pn, dn;
+    uint16_t mate_plies;
+    while (1)
+    {
+        // the numbers of the node from the children's, and the child to go into
+        int best = 0;
+        uint32_t best_number = DFPN_INFINITY + 1, second_best_number = DFPN_INFINITY;
+        uint32_t sum = 0;
+        int shortest_mate = MAX_PLY, longest_mate = 0;
+        pn = or_node ? DFPN_INFINITY : 0;
+        dn = or_node ? 0 : DFPN_INFINITY;
+        for (int i = 0; i < n_moves; i++)
+        {
+            uint32_t child_pn, child_dn;
+            uint16_t child_mate_plies;
+            dfpn_child_numbers(st, i, &child_pn, &child_dn, &child_mate_plies);
+            if (child_pn == 0)
+            {
+                if (child_mate_plies < shortest_mate)
+                    shortest_mate = child_mate_plies;
+                if (child_mate_plies > longest_mate)
+                    longest_mate = child_mate_plies;
+            }
+            // an OR node minimizes pn and sums dn, an AND node the other way around
+            uint32_t minimized = or_node ? child_pn : child_dn;
+            sum = dfpn_add(sum, or_node ? child_dn : child_pn);
+            if (minimized < best_number)
+            {
+                second_best_number = (best_number > DFPN_INFINITY) ? DFPN_INFINITY : best_number;
+                best_number = minimized;
+                best = i;
+            } else if (minimized < second_best_number) {
+                second_best_number = minimized;
+            }
+        }
+        if (or_node)
+        {
+            pn = best_number;
+            dn = sum;
+        } else {
+            pn = sum;
+            dn = best_number;
+        }
+        mate_plies = 1 + (or_node ? shortest_mate : longest_mate);
+
+        if (pn >= pn_threshold || dn >= dn_threshold || dfpn_should_stop())
+            break;
+
+        uint32_t child_pn_threshold, child_dn_threshold;
+        uint32_t child_pn, child_dn;
+        uint16_t child_mate_plies;
+        dfpn_child_numbers(st, best, &child_pn, &child_dn, &child_mate_plies);
+        if (or_node)
+        {
+            child_pn_threshold = dfpn_threshold_above(second_best_number);
+            if (child_pn_threshold > pn_threshold)
+                child_pn_threshold = pn_threshold;
+            child_dn_threshold = (dn_threshold >= DFPN_INFINITY) ? DFPN_INFINITY : dn_threshold - dn + child_dn;
+        } else {
+            child_dn_threshold = dfpn_threshold_above(second_best_number);
+            if (child_dn_threshold > dn_threshold)
+                child_dn_threshold = dn_threshold;
+            child_pn_threshold = (pn_threshold >= DFPN_INFINITY) ? DFPN_INFINITY : pn_threshold - pn + child_pn;
+        }
+        game_state child = make_move_2(s, st->moves[best]);
+        dfpn_mid(&child, ply + 1, remaining - 1, child_pn_threshold, child_dn_threshold);
+    }
+    dfpn_store(key, pn, dn, dfpn_nodes - nodes_before + 1, (pn == 0) ? mate_plies : 0);
+}
+
+int dfpn_mating_line(game_state* s, int remaining, Move* line)
+{
+    // follows the proof from `s`: the fastest mate for the attacker,
+    // the longest resistance for the defender
+    Move moves[MAX_MOVES];
+    game_state state = *s;
+    int length = 0;
+    while (length < MAX_PLY - 1)
+    {
+        int n_moves = get_legal_moves_as_move_array(&state, moves);
+        if (n_moves == 0)
+            break;
+        int or_node = (state.turn == dfpn_attacker);
+        Move chosen = 0;
+        for (int attempt = 0; attempt < 2 && chosen == 0; attempt++)
+        {
+            // the table can lose part of the proof when it fills up, then prove it again
+            if (attempt == 1)
+                dfpn_mid(&state, 0, remaining, DFPN_INFINITY, DFPN_INFINITY);
+            int chosen_plies = or_node ? MAX_PLY + 1 : -1;
+            for (int i = 0; i < n_moves; i++)
+            {
+                game_state child = make_move_2(&state, moves[i]);
+                uint32_t pn, dn;
+                uint16_t mate_plies;
+                if (!dfpn_lookup(dfpn_key(child.hash, remaining - 1), &pn, &dn, &mate_plies) || pn != 0)
+                    continue;
+                if (or_node ? mate_plies < chosen_plies : mate_plies > chosen_plies)
+                {
+                    chosen = moves[i];
+                    chosen_plies = mate_plies;
+                }
+            }
+        }
+        if (chosen == 0)
+            break;
+        line[length++] = chosen;
+        state = make_move_2(&state, chosen);
+        remaining--;
+    }
+    return length;
+}
+
+int solve_mate(game_state* s, int mate_in, uint64_t max_nodes, double max_milliseconds, MateSolution* solution)
+{
+    /*
+     * looks for a forced mate by the side to move in `s`, in at most
+     * `mate_in` moves, or the shortest up to DFPN_MAX_MATE moves with
+     * `mate_in` 0. 0 for `max_nodes`
+     * or `max_milliseconds` means no limit, search_stop stops it too
+     *
+     * returns solution->result, -1 also if the table can't be allocated
+     */
+    memset(solution, 0, sizeof(MateSolution));
+    solution->result = -1;
+    if (dfpn_table == NULL)
+        dfpn_table = calloc(DFPN_TT_SIZE, sizeof(DfpnEntry));
+    else
+        memset(dfpn_table, 0, DFPN_TT_SIZE * sizeof(DfpnEntry));
+    if (dfpn_table == NULL)
+        return -1;
+
+    double start_time = get_time_milliseconds();
+    dfpn_attacker = s->turn;
+    dfpn_nodes = 0;
+    dfpn_max_nodes = max_nodes;
+    dfpn_deadline = max_milliseconds ? start_time + max_milliseconds : 0;
+    dfpn_nodes_until_clock_check = DFPN_NODES_BETWEEN_CLOCK_CHECKS;
+    dfpn_aborted = 0;
+
+    if (mate_in > DFPN_MAX_MATE)
+        mate_in = DFPN_MAX_MATE;
+    int first = (mate_in > 0) ? mate_in : 1;
+    int last = (mate_in > 0) ? mate_in : DFPN_MAX_MATE;
+    for (int n = first; n <= last && !dfpn_aborted; n++)
+    {
+        int remaining = 2 * n - 1;
+        dfpn_mid(s, 0, remaining, DFPN_INFINITY, DFPN_INFINITY);
+
+        uint32_t pn, dn;
+        uint16_t mate_plies;
+        if (!dfpn_lookup(dfpn_key(s->hash, remaining), &pn, &dn, &mate_plies))
+            break;
+        if (pn == 0)
+        {
+            solution->result = 1;
+            solution->n_plies = mate_plies;
+            solution->line_length = dfpn_mating_line(s, remaining, solution->line);
+            break;
+        }
+        if (dn == 0 && !dfpn_aborted && n == last)
+            solution->result = 0;
+    }
+    solution->nodes = dfpn_nodes;
+    solution->time_milliseconds = get_time_milliseconds() - start_time;
+    return solution->result;
+}
+
+void mate_solver_free()
+{
+    free(dfpn_table);
+    dfpn_table = NULL;
+}
+
+#endif // MATE_SOLVER_H_
@@ -0,0 +1,447 @@
+#ifndef MCTS_H_
+#define MCTS_H_
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <math.h>
+#include <stdatomic.h>
+#include <unistd.h>
+
+#include "board.h"
+#include "legal_moves.h"
+#include "evaluation.h"
+#include "thread_pool.h"
+#include "ai.h"
+
+/*
+ * Monte-Carlo tree search, the other searcher next to the alpha-beta in ai.h
+ *
+ * Every playout walks down the tree from the root, at each node picking
+ * the child with the best mix of how well it has done (Q, the average
+ * result of the playouts through it, between 0 and 1) and how little it
+ * has been tried, until it reaches a leaf. The leaf's value is found, and
+ * the result is added to every node on the way back up. A leaf only gets
+ * its children the second time a playout reaches it, so the pool isn't
+ * spent on the many leaves that are never tried again. The move played is
+ * the root child that was visited the most
+ *
+ * Selection is either
+ *   UCT   Q + c * sqrt(ln N / n), every child gets tried once first
+ *   PUCT  Q + c * P * sqrt(N) / (1 + n), where the prior P of a move
+ *         comes from a softmax over the static evals of the children,
+ *         so the moves that look good get tried first and most
+ * with N the visits of the node and n those of the child
+ *
+ * A leaf is valued with eval_comprehensive, turned into a win probability,
+ * after a short random playout if mcts_options.playout_plies is set
+ *
+ * The search runs on all the workers of mcts_options.pool at once, all of
+ * them on the same tree. A thread going through a node counts a few
+ * visits that lose (the virtual loss) until its result comes back, so the
+ * other threads spread out to other lines instead of all following it.
+ * The nodes come out of one preallocated pool, children next to each
+ * other, handed out with an atomic counter
+ */
+
+enum MCTS_SELECTION { MCTS_UCT, MCTS_PUCT };
+
+typedef struct
+{
+    /*
+     * MctsOptions picks how the tree search works
+     *
+     *   selection      MCTS_UCT or MCTS_PUCT
+     *   exploration    c, how much trying the less visited moves is worth
+     *   playout_plies  random plies to play from a leaf before the eval,
+     *                  0 to just eval the leaf
+     *   pool           the workers to search on, NULL for just the calling
+     *                  thread. It can't be the pool the search itself runs on
+     */
+    int selection;
+    float exploration;
+    int playout_plies;
+    ThreadPool* pool;
+} MctsOptions;
+
+MctsOptions mcts_options = {MCTS_PUCT, 1.5, 0, NULL};
+
+// has to fit in an int, 2^21 nodes is 64MB
+#define MCTS_POOL_SIZE (1 << 21)
+// results are kept in thousandths of a win
+#define MCTS_VALUE_SCALE 1000
+#define MCTS_VIRTUAL_LOSS 3
+// centipawns for a factor e in the odds of winning
+#define MCTS_EVAL_SCALE 200.0
+// centipawns for a factor e in the priors of PUCT
+#define MCTS_PRIOR_TEMPERATURE 100.0
+// how much worse than its parent an unvisited child is assumed to be, for PUCT
+#define MCTS_FIRST_PLAY_REDUCTION 0.1
+// a search limited only by depth has no meaning here, it gets this many playouts
+#define MCTS_DEFAULT_PLAYOUTS 20000
+#define MCTS_PLAYOUTS_BETWEEN_CLOCK_CHECKS 64
+
+enum MCTS_NODE_STATES { MCTS_LEAF, MCTS_EXPANDING, MCTS_EXPANDED };
+
+typedef struct
+{
+    // including the virtual losses of the playouts still below it
+    atomic_int visits;
+    atomic_int first_child;
+    // from the point of view of the player who made `move`
+    atomic_llong value_sum;
+    float prior;
+    Move move;
+    uint16_t n_children;
+    atomic_uchar state;
+} MctsNode;
+
+typedef struct
+{
+    /*
+     * what one MCTS search did, the searcher's SearchStats
+     */
+    uint64_t playouts;
+    int tree_nodes;
+    int n_threads;
+    double time_milliseconds;
+    Move best_move;
+    int best_move_visits;
+    float win_probability;
+    Value value;
+    // the node pool ran out, and the leaves stopped being expanded
+    int pool_full;
+} MctsStats;
+
+MctsNode* mcts_nodes = NULL;
+atomic_int mcts_n_nodes;
+atomic_int mcts_pool_full;
+atomic_int mcts_stop;
+atomic_ullong mcts_n_playouts;
+// a ponder hit can change it mid search
+atomic_ullong mcts_max_playouts;
+game_state mcts_root_state;
+MctsStats mcts_stats;
+
+void mcts_init_node(MctsNode* node, Move move, float prior)
+{
+    atomic_init(&node->visits, 0);
+    atomic_init(&node->first_child, -1);
+    atomic_init(&node->value_sum, 0);
+    atomic_init(&node->state, MCTS_LEAF);
+    node->prior = prior;
+    node->move = move;
+    node->n_children = 0;
+}
+
+int mcts_alloc_nodes(int n)
+{
+    // returns the index of `n` fresh nodes in a row, -1 if the pool is full
+    int first = atomic_fetch_add_explicit(&mcts_n_nodes, n, memory_order_relaxed);
+    if (first + n > MCTS_POOL_SIZE)
+    {
+        atomic_store_explicit(&mcts_pool_full, 1, memory_order_relaxed);
+        return -1;
+    }
+    return first;
+}
+
+float mcts_win_probability(Value v, int player)
+{
+    // `v` is from white's point of view
+    float white = 1.0 / (1.0 + exp(-v / MCTS_EVAL_SCALE));
+    return (player == WHITE) ? white : 1.0 - white;
+}
+
+float mcts_q(MctsNode* node, float first_play)
+{
+    int visits = atomic_load_explicit(&node->visits, memory_order_relaxed);
+    if (visits == 0)
+        return first_play;
+    return atomic_load_explicit(&node->value_sum, memory_order_relaxed) / ((float) MCTS_VALUE_SCALE * visits);
+}
+
+void mcts_expand(MctsNode* node, game_state* s)
+{
+    // gives `node` its children, unless another thread is already on it
+    unsigned char leaf = MCTS_LEAF;
+    if (atomic_load_explicit(&mcts_pool_full, memory_order_relaxed)
+            || !atomic_compare_exchange_strong(&node->state, &leaf, MCTS_EXPANDING))
+        return;
+    Move* moves = search_stack[0].moves;
+    Value* scores = search_stack[0].scores;
+    int n_moves = get_legal_moves_as_move_array(s, moves);
+    int first = (n_moves > 0) ? mcts_alloc_nodes(n_moves) : -1;
+    if (n_moves > 0 && first == -1)
+    {
+        atomic_store_explicit(&node->state, MCTS_LEAF, memory_order_release);
+        return;
+    }
+
+    // PUCT's priors, a softmax over how the moves eval for the side to move
+    float total = 0.0;
+    Value best_score = -VALUE_INFINITE;
+    if (mcts_options.selection == MCTS_PUCT)
+    {
+        for (int i = 0; i < n_moves; i++)
+        {
+            game_state child = make_move_2(s, moves[i]);
+            scores[i] = eval_comprehensive(&child) * ((s->turn == WHITE) ? 1 : -1);
+            if (scores[i] > best_score)
+                best_score = scores[i];
+        }
+        for (int i = 0; i < n_moves; i++)
+            total += exp((scores[i] - best_score) / MCTS_PRIOR_TEMPERATURE);
+    }
+    for (int i = 0; i < n_moves; i++)
+    {
+        float prior = (mcts_options.selection == MCTS_PUCT)
+            ? exp((scores[i] - best_score) / MCTS_PRIOR_TEMPERATURE) / total
+            : 1.0 / n_moves;
+        mcts_init_node(&mcts_nodes[first + i], moves[i], prior);
+    }
+    node->n_children = n_moves;
+    atomic_store_explicit(&node->first_child, first, memory_order_relaxed);
+    atomic_store_explicit(&node->state, MCTS_EXPANDED, memory_order_release);
+}
+
+MctsNode* mcts_select_child(MctsNode* node)
+{
+    MctsNode* children = &mcts_nodes[atomic_load_explicit(&node->first_child, memory_order_relaxed)];
+    int parent_visits = atomic_load_explicit(&node->visits, memory_order_relaxed);
+    float log_parent_visits = log(parent_visits + 1);
+    float sqrt_parent_visits = sqrt(parent_visits + 1);
+    // the children's Q is for the side to move here, the node's own for the other side
+    float first_play = 1.0 - mcts_q(node, 0.5) - MCTS_FIRST_PLAY_REDUCTION;
+
+    MctsNode* best = &children[0];
+    float best_score = -1e30;
+    for (int i = 0; i < node->n_children; i++)
+    {
+        MctsNode* child = &children[i];
+        int visits = atomic_load_explicit(&child->visits, memory_order_relaxed);
+        float score;
+        if (mcts_options.selection == MCTS_UCT)
+        {
+            if (visits == 0)
+                return child;
+            score = mcts_q(child, 0.0) + mcts_options.exploration * sqrt(log_parent_visits / visits);
+        } else {
+            score = mcts_q(child, first_play) + mcts_options.exploration * child->prior * sqrt_parent_visits / (1 + visits);
+        }
+        if (score > best_score)
+        {
+            best_score = score;
+            best = child;
+        }
+    }
+    return best;
+}
+
+uint64_t mcts_random(uint64_t* rng)
+{
+    // xorshift64
+    *rng ^= *rng << 13;
+    *rng ^= *rng >> 7;
+    *rng ^= *rng << 17;
+    return *rng;
+}
+
+float mcts_leaf_value(game_state* s, uint64_t* rng)
+{
+    // the value of `s` for the player who just moved into it
+    int mover = get_opponent(s->turn);
+    game_state state = *s;
+    Move* moves = search_stack[1].moves;
+    for (int ply = 0; ; ply++)
+    {
+        int n_moves = get_legal_moves_as_move_array(&state, moves);
+        if (n_moves == 0)
+        {
+            if (!is_side_to_move_in_check(&state))
+                return 0.5;
+            return (state.turn == mover) ? 0.0 : 1.0;
+        }
+        if (ply >= mcts_options.playout_plies)
+            break;
+        state = make_move_2(&state, moves[mcts_random(rng) % n_moves]);
+    }
+    return mcts_win_probability(eval_comprehensive(&state), mover);
+}
+
+void mcts_playout(uint64_t* rng)
+{
+    int path[MAX_PLY];
+    int length = 0;
+    game_state state = mcts_root_state;
+    MctsNode* node = &mcts_nodes[0];
+    path[length++] = 0;
+    atomic_fetch_add_explicit(&node->visits, MCTS_VIRTUAL_LOSS, memory_order_relaxed);
+
+    while (atomic_load_explicit(&node->state, memory_order_acquire) == MCTS_EXPANDED
+            && node->n_children > 0 && length < MAX_PLY)
+    {
+        node = mcts_select_child(node);
+        atomic_fetch_add_explicit(&node->visits, MCTS_VIRTUAL_LOSS, memory_order_relaxed);
+        path[length++] = node - mcts_nodes;
+        state = make_move_2(&state, node->move);
+    }
+    // a leaf that only has this playout's virtual loss on it hasn't been valued yet
+    if (atomic_load_explicit(&node->state, memory_order_relaxed) == MCTS_LEAF
+            && atomic_load_explicit(&node->visits, memory_order_relaxed) > MCTS_VIRTUAL_LOSS)
+        mcts_expand(node, &state);
+
+    // take the virtual losses back, and add the result, flipping it every ply
+    float value = mcts_leaf_value(&state, rng);
+    for (int i = length - 1; i >= 0; i--)
+    {
+        MctsNode* n = &mcts_nodes[path[i]];
+        atomic_fetch_add_explicit(&n->value_sum, (long long) lrintf(value * MCTS_VALUE_SCALE), memory_order_relaxed);
+        atomic_fetch_sub_explicit(&n->visits, MCTS_VIRTUAL_LOSS - 1, memory_order_relaxed);
+        value = 1.0 - value;
+    }
+    atomic_fetch_add_explicit(&mcts_n_playouts, 1, memory_order_relaxed);
+}
+
+int mcts_done()
+{
+    if (atomic_load_explicit(&mcts_stop, memory_order_relaxed) || atomic_load_explicit(&search_stop, memory_order_relaxed))
+        return 1;
+    uint64_t max_playouts = atomic_load_explicit(&mcts_max_playouts, memory_order_relaxed);
+    return max_playouts && atomic_load_explicit(&mcts_n_playouts, memory_order_relaxed) >= max_playouts;
+}
+
+void mcts_worker(void* arg)
+{
+    uint64_t rng = 0x9E3779B97F4A7C15ull * (uintptr_t) arg + 1;
+    while (!mcts_done())
+        mcts_playout(&rng);
+}
+
+void mcts_check_limits()
+{
+    // the clock, and the limits a ponder hit brings, are only looked at by the
+    // thread that started the search, the workers only see mcts_stop
+    apply_ponderhit();
+    SearchLimits* limits = &search_limits;
+    uint64_t max_playouts = 0;
+    if (!limits->infinite)
+    {
+        max_playouts = limits->nodes;
+        if (!limits->nodes && !search_time_budget)
+            max_playouts = MCTS_DEFAULT_PLAYOUTS;
+        if (search_time_budget && get_time_milliseconds() - search_clock_start >= search_time_budget)
+            atomic_store(&mcts_stop, 1);
+    }
+    atomic_store_explicit(&mcts_max_playouts, max_playouts, memory_order_relaxed);
+}
+
+int choose_best_move_mcts(game_state* s, const SearchLimits* limits, Move* move, double* time_taken_for_search_milliseconds)
+{
+    /*
+     * Searches `s` with MCTS until one of the `limits` is hit, nodes counting
+     * playouts, then plays the most visited move, same as choose_best_move
+     *
+     * returns 1 if a move was found
+     *        -1 if there are no legal moves, or the node pool can't be allocated
+     */
+    double start_time = get_time_milliseconds();
+    search_limits = *limits;
+    search_clock_start = start_time;
+    search_root_turn = s->turn;
+    EVAL_PROFILE_CLEAR();
+    budget_search_time();
+
+    if (mcts_nodes == NULL)
+        mcts_nodes = malloc(MCTS_POOL_SIZE * sizeof(MctsNode));
+    if (mcts_nodes == NULL)
+        return -1;
+    atomic_store(&mcts_n_nodes, 1);
+    atomic_store(&mcts_pool_full, 0);
+    atomic_store(&mcts_stop, 0);
+    atomic_store(&mcts_n_playouts, 0);
+    mcts_root_state = *s;
+    mcts_init_node(&mcts_nodes[0], 0, 1.0);
+    mcts_expand(&mcts_nodes[0], s);
+    if (mcts_nodes[0].n_children == 0)
+        return -1;
+    mcts_check_limits();
+
+    ThreadPool* pool = mcts_options.pool;
+    int n_threads = (pool != NULL) ? pool->n_workers : 1;
+    if (pool != NULL)
+    {
+        Future workers[THREAD_POOL_MAX_WORKERS];
+        for (int i = 0; i < n_threads; i++)
+            thread_pool_submit(pool, &workers[i], &mcts_worker, (void*) (uintptr_t) i);
+        while (!mcts_done())
+        {
+            usleep(1000);
+            mcts_check_limits();
+        }
+        atomic_store(&mcts_stop, 1);
+        for (int i = 0; i < n_threads; i++)
+            future_wait(pool, &workers[i]);
+    } else {
+        uint64_t rng = 1;
+        while (!mcts_done())
+        {
+            for (int i = 0; i < MCTS_PLAYOUTS_BETWEEN_CLOCK_CHECKS && !mcts_done(); i++)
+                mcts_playout(&rng);
+            mcts_check_limits();
+        }
+    }
+
+    // the most visited move, the best Q between moves visited as often
+    MctsNode* root = &mcts_nodes[0];
+    MctsNode* children = &mcts_nodes[atomic_load(&root->first_child)];
+    MctsNode* best = &children[0];
+    for (int i = 1; i < root->n_children; i++)
+    {
+        int visits = atomic_load(&children[i].visits), best_visits = atomic_load(&best->visits);
+        if (visits > best_visits || (visits == best_visits && mcts_q(&children[i], 0.0) > mcts_q(best, 0.0)))
+            best = &children[i];
+    }
+    *move = best->move;
+    *time_taken_for_search_milliseconds = get_time_milliseconds() - start_time;
+
+    uint64_t playouts = atomic_load(&mcts_n_playouts);
+    n_states_explored = playouts;
+    mcts_stats.playouts = playouts;
+    mcts_stats.tree_nodes = (atomic_load(&mcts_n_nodes) < MCTS_POOL_SIZE) ? atomic_load(&mcts_n_nodes) : MCTS_POOL_SIZE;
+    mcts_stats.n_threads = n_threads;
+    mcts_stats.time_milliseconds = *time_taken_for_search_milliseconds;
+    mcts_stats.best_move = best->move;
+    mcts_stats.best_move_visits = atomic_load(&best->visits);
+    mcts_stats.win_probability = mcts_q(best, 0.5);
+    // back to centipawns from white's point of view, the same way it was turned into a probability
+    float p = fminf(fmaxf(mcts_stats.win_probability, 0.001), 0.999);
+    Value v = (Value) lrintf(MCTS_EVAL_SCALE * log(p / (1.0 - p)));
+    mcts_stats.value = (s->turn == WHITE) ? v : -v;
+    mcts_stats.pool_full = atomic_load(&mcts_pool_full);
+
+    if (search_stats_output != NULL)
+    {
+        char uci[6];
+        move_to_uci(best->move, uci);
+        double seconds = mcts_stats.time_milliseconds / 1000.0;
+        fprintf(search_stats_output, "{\"searcher\":\"mcts\",\"selection\":\"%s\",\"threads\":%d,"
+                "\"playouts\":%llu,\"time_ms\":%.3f,\"playouts_per_second\":%.0f,\"tree_nodes\":%d,"
+                "\"best_move\":\"%s\",\"visits\":%d,\"win_probability\":%.4f,\"value\":%d,\"pool_full\":%s}\n",
+                (mcts_options.selection == MCTS_UCT) ? "uct" : "puct", n_threads,
+                (unsigned long long) playouts, mcts_stats.time_milliseconds,
+                (seconds > 0) ? playouts / seconds : 0.0, mcts_stats.tree_nodes,
+                uci, mcts_stats.best_move_visits, mcts_stats.win_probability, mcts_stats.value,
+                mcts_stats.pool_full ? "true" : "false");
+        fflush(search_stats_output);
+    }
+    EVAL_PROFILE_PRINT(stderr);
+    return 1;
+}
+
+void mcts_free()
+{
+    free(mcts_nodes);
+    mcts_nodes = NULL;
+}
+
+#endif // MCTS_H_
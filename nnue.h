@@ -0,0 +1,428 @@
+#ifndef NNUE_H_
+#define NNUE_H_
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdalign.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+#include "board.h"
+#include "bitutils.h"
+#include "legal_moves.h"
+
+/*
+ * An efficiently updatable neural network (NNUE) evaluation
+ *
+ * The inputs are HalfKP features, from each side's point of view: for
+ * every piece other than the kings, where it is, what it is, whose it is,
+ * and where that side's own king is, 64 * 10 * 64 inputs of which only
+ * the ~30 that are there are ever 1. The board is flipped top to bottom
+ * for black, so both sides see their own pieces coming up from the bottom
+ *
+ *     2 x 40960 inputs -> 2 x 256 -> 32 -> 32 -> 1
+ *
+ * The first layer is the big one, but a move only changes a few of its
+ * inputs, so its output (the accumulator) is kept per position and
+ * updated from the position before by adding and subtracting the weight
+ * rows of the pieces that moved. Only a move of a side's own king changes
+ * all of that side's inputs and recomputes it from scratch. The
+ * accumulators are kept in a small per thread table indexed by the hash,
+ * like the pawn table, and a position finds the one of the position
+ * before through the previous_hash and the changes make_move_2 records
+ *
+ * Everything is fixed point: the accumulator is int16, clipped to 0..127
+ * it is the int8 input of the next layer, whose int32 sums are shifted
+ * down by NNUE_WEIGHT_SHIFT and clipped again. Those dot products use
+ * AVX2 or SSSE3 when the CPU has them, picked when the network is loaded
+ *
+ * The network file is mmapped and used in place, all little endian:
+ *     the header       "CHSNNUE1" and the four layer sizes as uint32,
+ *                      padded to 64 bytes
+ *     int16 ft_biases[256]            int16 ft_weights[40960][256]
+ *     int32 l1_biases[32]             int8 l1_weights[32][512]
+ *     int32 l2_biases[32]             int8 l2_weights[32][32]
+ *     int32 out_bias                  int8 out_weights[32]
+ * every array padded to a multiple of 64 bytes. The side to move's half
+ * of the first layer comes first in l1_weights, and the output is
+ * centipawns for the side to move, times NNUE_OUTPUT_SCALE
+ */
+
+#define NNUE_N_PIECE_KINDS 10
+#define NNUE_N_INPUTS (64 * NNUE_N_PIECE_KINDS * 64)
+#define NNUE_L1 256
+#define NNUE_L2 32
+#define NNUE_L3 32
+
+#define NNUE_WEIGHT_SHIFT 6
+#define NNUE_OUTPUT_SCALE 16
+// a network can say anything, the search needs the evals to stay clear of the mate scores
+#define NNUE_MAX_VALUE 8000
+
+#define NNUE_MAGIC "CHSNNUE1"
+#define NNUE_HEADER_SIZE 64
+
+// has to be a power of two, 512 accumulators are 512KB per thread
+#define NNUE_ACCUMULATOR_CACHE_SIZE 512
+
+typedef struct
+{
+    char magic[8];
+    uint32_t n_inputs;
+    uint32_t l1;
+    uint32_t l2;
+    uint32_t l3;
+} NnueHeader;
+
+typedef struct
+{
+    const int16_t* ft_biases;
+    const int16_t* ft_weights;
+    const int32_t* l1_biases;
+    const int8_t* l1_weights;
+    const int32_t* l2_biases;
+    const int8_t* l2_weights;
+    const int32_t* out_bias;
+    const int8_t* out_weights;
+} NnueNetwork;
+
+typedef struct
+{
+    // indexed by the point of view, WHITE or BLACK
+    alignas(64) int16_t values[2][NNUE_L1];
+    uint64_t key;
+} NnueAccumulator;
+
+typedef void (*NnueAffineFunction)(const uint8_t* in, int n_in, const int8_t* weights,
+        const int32_t* biases, uint8_t* out, int n_out);
+
+NnueNetwork nnue_network;
+void* nnue_mapped = NULL;
+size_t nnue_mapped_size = 0;
+// eval_comprehensive uses the network when this is set, nnue_init sets it
+int nnue_enabled = 0;
+_Thread_local NnueAccumulator nnue_accumulators[NNUE_ACCUMULATOR_CACHE_SIZE];
+
+int nnue_piece_kind(int piece, int perspective)
+{
+    // 0 to 4 for the side's own pawn, knight, bishop, rook and queen, 5 to 9 for the opponent's
+    static const int kinds[6] = {[W_ROOK] = 3, [W_KNIGHT] = 1, [W_BISHOP] = 2, [W_QUEEN] = 4, [W_PAWN] = 0};
+    int kind = kinds[piece & 7];
+    return (get_player(piece) == perspective) ? kind : kind + 5;
+}
+
+int nnue_orient(int square, int perspective)
+{
+    return (perspective == WHITE) ? square : (square ^ 56);
+}
+
+int nnue_feature(int king_square, int piece, int square, int perspective)
+{
+    return (nnue_orient(king_square, perspective) * NNUE_N_PIECE_KINDS + nnue_piece_kind(piece, perspective)) * 64
+        + nnue_orient(square, perspective);
+}
+
+int nnue_is_feature(int piece)
+{
+    return !is_blank(piece) && !is_king(piece);
+}
+
+MULTIVERSIONED
+void nnue_refresh(game_state* s, int16_t* values, int perspective)
+{
+    // the accumulator of one side, from scratch
+    memcpy(values, nnue_network.ft_biases, NNUE_L1 * sizeof(int16_t));
+    int king_square = find_piece(s, (perspective == WHITE) ? W_KING : B_KING);
+    uint64_t pieces = s->white_pieces | s->black_pieces;
+    while (pieces)
+    {
+        int square = pop_lsb(&pieces);
+        int piece = s->squares[square];
+        if (!nnue_is_feature(piece))
+            continue;
+        const int16_t* row = &nnue_network.ft_weights[nnue_feature(king_square, piece, square, perspective) * NNUE_L1];
+        for (int i = 0; i < NNUE_L1; i++)
+            values[i] += row[i];
+    }
+}
+
+MULTIVERSIONED
+void nnue_update(const int16_t* previous, int16_t* values, game_state* s, int perspective)
+{
+    // the accumulator of one side, from the one of the position before `s`,
+    // `previous` and `values` can be the same
+    if (values != previous)
+        memcpy(values, previous, NNUE_L1 * sizeof(int16_t));
+    int king_square = find_piece(s, (perspective == WHITE) ? W_KING : B_KING);
+    for (int c = 0; c < s->n_changes; c++)
+    {
+        SquareChange* change = &s->changes[c];
+        if (nnue_is_feature(change->removed))
+        {
+            const int16_t* row = &nnue_network.ft_weights[nnue_feature(king_square, change->removed, change->square, perspective) * NNUE_L1];
+            for (int i = 0; i < NNUE_L1; i++)
+                values[i] -= row[i];
+        }
+        if (nnue_is_feature(change->added))
+        {
+            const int16_t* row = &nnue_network.ft_weights[nnue_feature(king_square, change->added, change->square, perspective) * NNUE_L1];
+            for (int i = 0; i < NNUE_L1; i++)
+                values[i] += row[i];
+        }
+    }
+}
+
+int nnue_king_moved(game_state* s, int perspective)
+{
+    int king = (perspective == WHITE) ? W_KING : B_KING;
+    for (int c = 0; c < s->n_changes; c++)
+        if (s->changes[c].added == king)
+            return 1;
+    return 0;
+}
+
+NnueAccumulator* nnue_accumulator(game_state* s)
+{
+    // the accumulator of `s`, updated from the position before if that one's is still in the table
+    NnueAccumulator* entry = &nnue_accumulators[s->hash & (NNUE_ACCUMULATOR_CACHE_SIZE - 1)];
+    if (entry->key == s->hash)
+        return entry;
+    NnueAccumulator* previous = &nnue_accumulators[s->previous_hash & (NNUE_ACCUMULATOR_CACHE_SIZE - 1)];
+    int incremental = s->n_changes >= 0 && previous->key == s->previous_hash;
+    for (int perspective = WHITE; perspective <= BLACK; perspective++)
+    {
+        if (incremental && !nnue_king_moved(s, perspective))
+            nnue_update(previous->values[perspective], entry->values[perspective], s, perspective);
+        else
+            nnue_refresh(s, entry->values[perspective], perspective);
+    }
+    entry->key = s->hash;
+    return entry;
+}
+
+void nnue_clear_accumulators()
+{
+    // the calling thread's
+    for (int i = 0; i < NNUE_ACCUMULATOR_CACHE_SIZE; i++)
+        nnue_accumulators[i].key = 0;
+}
+
+void nnue_affine_scalar(const uint8_t* in, int n_in, const int8_t* weights,
+        const int32_t* biases, uint8_t* out, int n_out)
+{
+    // out = clip((biases + weights * in) >> NNUE_WEIGHT_SHIFT), weights is n_out rows of n_in
+    for (int o = 0; o < n_out; o++)
+    {
+        int32_t sum = biases[o];
+        const int8_t* row = &weights[o * n_in];
+        for (int i = 0; i < n_in; i++)
+            sum += row[i] * in[i];
+        sum >>= NNUE_WEIGHT_SHIFT;
+        out[o] = (sum < 0) ? 0 : (sum > 127) ? 127 : sum;
+    }
+}
+
+#if defined(__x86_64__)
+__attribute__((target("avx2")))
+int32_t nnue_horizontal_sum_avx2(__m256i sums)
+{
+    __m128i sum = _mm_add_epi32(_mm256_castsi256_si128(sums), _mm256_extracti128_si256(sums, 1));
+    sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, 0x4E));
+    sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, 0xB1));
+    return _mm_cvtsi128_si32(sum);
+}
+
+__attribute__((target("avx2")))
+void nnue_affine_avx2(const uint8_t* in, int n_in, const int8_t* weights,
+        const int32_t* biases, uint8_t* out, int n_out)
+{
+    // n_in has to be a multiple of 32 and n_out of 4, four rows at a time
+    // share the loads of the inputs. The inputs are at most 127, so the
+    // pairs maddubs adds up can't saturate the int16s
+    const __m256i ones = _mm256_set1_epi16(1);
+    for (int o = 0; o < n_out; o += 4)
+    {
+        const int8_t* row = &weights[o * n_in];
+        __m256i sums[4] = {_mm256_setzero_si256(), _mm256_setzero_si256(), _mm256_setzero_si256(), _mm256_setzero_si256()};
+        for (int i = 0; i < n_in; i += 32)
+        {
+            __m256i x = _mm256_loadu_si256((const __m256i*) &in[i]);
+            for (int r = 0; r < 4; r++)
+            {
+                __m256i w = _mm256_loadu_si256((const __m256i*) &row[r * n_in + i]);
+                sums[r] = _mm256_add_epi32(sums[r], _mm256_madd_epi16(_mm256_maddubs_epi16(x, w), ones));
+            }
+        }
+        for (int r = 0; r < 4; r++)
+        {
+            int32_t total = (biases[o + r] + nnue_horizontal_sum_avx2(sums[r])) >> NNUE_WEIGHT_SHIFT;
+            out[o + r] = (total < 0) ? 0 : (total > 127) ? 127 : total;
+        }
+    }
+}
+
+__attribute__((target("ssse3")))
+void nnue_affine_ssse3(const uint8_t* in, int n_in, const int8_t* weights,
+        const int32_t* biases, uint8_t* out, int n_out)
+{
+    // the same with 16 bytes at a time, n_in has to be a multiple of 16
+    const __m128i ones = _mm_set1_epi16(1);
+    for (int o = 0; o < n_out; o++)
+    {
+        const int8_t* row = &weights[o * n_in];
+        __m128i sum = _mm_setzero_si128();
+        for (int i = 0; i < n_in; i += 16)
+        {
+            __m128i x = _mm_loadu_si128((const __m128i*) &in[i]);
+            __m128i w = _mm_loadu_si128((const __m128i*) &row[i]);
+            sum = _mm_add_epi32(sum, _mm_madd_epi16(_mm_maddubs_epi16(x, w), ones));
+        }
+        sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, 0x4E));
+        sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, 0xB1));
+        int32_t total = (biases[o] + _mm_cvtsi128_si32(sum)) >> NNUE_WEIGHT_SHIFT;
+        out[o] = (total < 0) ? 0 : (total > 127) ? 127 : total;
+    }
+}
+#endif
+
+NnueAffineFunction nnue_affine = &nnue_affine_scalar;
+const char* nnue_affine_name = "scalar";
+
+void nnue_select_affine()
+{
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+    {
+        nnue_affine = &nnue_affine_avx2;
+        nnue_affine_name = "avx2";
+    } else if (__builtin_cpu_supports("ssse3")) {
+        nnue_affine = &nnue_affine_ssse3;
+        nnue_affine_name = "ssse3";
+    }
+#endif
+}
+
+MULTIVERSIONED
+void nnue_transform(NnueAccumulator* accumulator, int turn, uint8_t* input)
+{
+    // the accumulator clipped to 0..127, the side to move's half first
+    for (int half = 0; half < 2; half++)
+    {
+        const int16_t* values = accumulator->values[half == 0 ? turn : get_opponent(turn)];
+        for (int i = 0; i < NNUE_L1; i++)
+            input[half * NNUE_L1 + i] = (values[i] < 0) ? 0 : (values[i] > 127) ? 127 : values[i];
+    }
+}
+
+int nnue_forward(NnueAccumulator* accumulator, int turn)
+{
+    // the rest of the network, returns centipawns from white's point of view
+    alignas(64) uint8_t input[2 * NNUE_L1];
+    alignas(64) uint8_t hidden_1[NNUE_L2];
+    alignas(64) uint8_t hidden_2[NNUE_L3];
+    nnue_transform(accumulator, turn, input);
+    nnue_affine(input, 2 * NNUE_L1, nnue_network.l1_weights, nnue_network.l1_biases, hidden_1, NNUE_L2);
+    nnue_affine(hidden_1, NNUE_L2, nnue_network.l2_weights, nnue_network.l2_biases, hidden_2, NNUE_L3);
+    int32_t output = *nnue_network.out_bias;
+    for (int i = 0; i < NNUE_L3; i++)
+        output += nnue_network.out_weights[i] * hidden_2[i];
+
+    int value = output / NNUE_OUTPUT_SCALE;
+    value = (value > NNUE_MAX_VALUE) ? NNUE_MAX_VALUE : (value < -NNUE_MAX_VALUE) ? -NNUE_MAX_VALUE : value;
+    return (turn == WHITE) ? value : -value;
+}
+
+int nnue_evaluate(game_state* s)
+{
+    // centipawns from white's point of view
+    return nnue_forward(nnue_accumulator(s), s->turn);
+}
+
+const void* nnue_section(const uint8_t* data, size_t* offset, size_t size)
+{
+    // the next array of the file, they all start on 64 bytes
+    const void* ret = data + *offset;
+    *offset += (size + 63) / 64 * 64;
+    return ret;
+}
+
+int nnue_init(const char* file_name)
+{
+    /*
+     * maps the network and makes eval_comprehensive use it, before any search starts
+     *
+     * returns 1 if the network can be used
+     *        -1 if the file can't be read or isn't a network of this shape
+     */
+    int fd = open(file_name, O_RDONLY);
+    struct stat st;
+    if (fd == -1 || fstat(fd, &st) != 0)
+    {
+        fprintf(stderr, "Can't read the network %s\n", file_name);
+        if (fd != -1)
+            close(fd);
+        return -1;
+    }
+
+    size_t size = NNUE_HEADER_SIZE;
+    size_t sizes[] = {
+        NNUE_L1 * sizeof(int16_t), (size_t) NNUE_N_INPUTS * NNUE_L1 * sizeof(int16_t),
+        NNUE_L2 * sizeof(int32_t), NNUE_L2 * 2 * NNUE_L1,
+        NNUE_L3 * sizeof(int32_t), NNUE_L3 * NNUE_L2,
+        sizeof(int32_t), NNUE_L3,
+    };
+    for (int i = 0; i < 8; i++)
+        size += (sizes[i] + 63) / 64 * 64;
+    if ((size_t) st.st_size != size)
+    {
+        fprintf(stderr, "%s is %lld bytes, a network is %zu\n", file_name, (long long) st.st_size, size);
+        close(fd);
+        return -1;
+    }
+    void* map = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return -1;
+
+    const NnueHeader* header = (const NnueHeader*) map;
+    if (memcmp(header->magic, NNUE_MAGIC, 8) != 0 || header->n_inputs != NNUE_N_INPUTS
+            || header->l1 != NNUE_L1 || header->l2 != NNUE_L2 || header->l3 != NNUE_L3)
+    {
+        fprintf(stderr, "%s isn't a %d x %d x %d x %d network\n", file_name, NNUE_N_INPUTS, NNUE_L1, NNUE_L2, NNUE_L3);
+        munmap(map, size);
+        return -1;
+    }
+
+    const uint8_t* data = (const uint8_t*) map;
+    size_t offset = NNUE_HEADER_SIZE;
+    nnue_network.ft_biases = nnue_section(data, &offset, sizes[0]);
+    nnue_network.ft_weights = nnue_section(data, &offset, sizes[1]);
+    nnue_network.l1_biases = nnue_section(data, &offset, sizes[2]);
+    nnue_network.l1_weights = nnue_section(data, &offset, sizes[3]);
+    nnue_network.l2_biases = nnue_section(data, &offset, sizes[4]);
+    nnue_network.l2_weights = nnue_section(data, &offset, sizes[5]);
+    nnue_network.out_bias = nnue_section(data, &offset, sizes[6]);
+    nnue_network.out_weights = nnue_section(data, &offset, sizes[7]);
+    nnue_mapped = map;
+    nnue_mapped_size = size;
+    nnue_select_affine();
+    nnue_clear_accumulators();
+    nnue_enabled = 1;
+    return 1;
+}
+
+void nnue_free()
+{
+    if (nnue_mapped != NULL)
+        munmap(nnue_mapped, nnue_mapped_size);
+    nnue_mapped = NULL;
+    nnue_enabled = 0;
+}
+
+#endif // NNUE_H_
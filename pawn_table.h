@@ -0,0 +1,154 @@
+#ifndef PAWN_TABLE_H_
+#define PAWN_TABLE_H_
+#include <stdint.h>
+
+#include "board.h"
+#include "legal_moves.h"
+#include "piece_square.h"
+
+/*
+ * The pawn hash table caches everything the evaluation derives from the
+ * pawns alone
+ *
+ * Pawns move rarely, so a huge number of the leaves of a search share
+ * the same pawn skeleton. The table is indexed by the pawn_hash of a
+ * game_state, which only covers the pawns, and each entry keeps the
+ * pawn structure score, passed, isolated and doubled pawns, and the masks
+ * it's worked out from, which the tuner counts the same terms on
+ *
+ * The table is per thread, so searches on different threads never race on it
+ */
+
+// has to be a power of two
+#define PAWN_TABLE_SIZE 4096
+
+// a passed pawn is worth PASSED_PAWN_ROW_1 on its starting row up to
+// PASSED_PAWN_ROW_6 a step from promoting, on top of its material and
+// space, the rows counted from the pawn's own side like PAWN_SPACE
+#define PASSED_PAWN(row) \
+    ((row) == 1 ? PASSED_PAWN_ROW_1 : (row) == 2 ? PASSED_PAWN_ROW_2 : (row) == 3 ? PASSED_PAWN_ROW_3 : \
+     (row) == 4 ? PASSED_PAWN_ROW_4 : (row) == 5 ? PASSED_PAWN_ROW_5 : (row) == 6 ? PASSED_PAWN_ROW_6 : 0)
+
+// the squares of file 0, the a file, the others are shifts of it
+#define PAWN_FILE_A 0x0101010101010101ULL
+
+typedef struct
+{
+    uint64_t key;
+    // the passed, isolated and doubled pawns, white's minus black's
+    Score score;
+
+    // all the masks are indexed by player, 0 for WHITE and 1 for BLACK
+    uint64_t pawns[2];
+    // pawns with no opponent pawn in front of them on their own or the adjacent files
+    uint64_t passed_pawns[2];
+    // bit f is set if the player has no pawn on file f
+    uint8_t half_open_files[2];
+} PawnEntry;
+
+_Thread_local PawnEntry pawn_table[PAWN_TABLE_SIZE];
+_Thread_local unsigned int n_pawn_table_probes = 0;
+_Thread_local unsigned int n_pawn_table_hits = 0;
+
+int pawn_row(int player, int square)
+{
+    // the row of the player's pawn on `square`, counted from the player's side
+    return (player == WHITE) ? 7 - square / 8 : square / 8;
+}
+
+int count_isolated_pawns(const PawnEntry* entry, int player)
+{
+    // the player's pawns with no pawn of theirs on the files next to them
+    int isolated = 0;
+    for (int x = 0; x < 8; x++)
+    {
+        int left = (x == 0) || (entry->half_open_files[player] & (1 << (x - 1)));
+        int right = (x == 7) || (entry->half_open_files[player] & (1 << (x + 1)));
+        if (left && right)
+            isolated += popcount(entry->pawns[player] & (PAWN_FILE_A << x));
+    }
+    return isolated;
+}
+
+int count_doubled_pawns(const PawnEntry* entry, int player)
+{
+    // the player's pawns on a file with another of their pawns in front of them
+    int doubled = 0;
+    for (int x = 0; x < 8; x++)
+    {
+        int on_file = popcount(entry->pawns[player] & (PAWN_FILE_A << x));
+        if (on_file > 1)
+            doubled += on_file - 1;
+    }
+    return doubled;
+}
+
+uint64_t pawn_front_span(int player, int square)
+{
+    // the squares in front of the player's pawn on `square`, on its own
+    // file and the adjacent ones. White moves towards square 0
+    int x = board_index_to_coord_x(square);
+    uint64_t files = PAWN_FILE_A << x;
+    files |= ((x > 0) ? files >> 1 : 0) | ((x < 7) ? files << 1 : 0);
+    uint64_t ahead = (player == WHITE) ? (1ULL << (square & ~7)) - 1 : ~((2ULL << (square | 7)) - 1);
+    return files & ahead;
+}
+
+void fill_pawn_entry(game_state* s, PawnEntry* entry)
+{
+    entry->key = s->pawn_hash;
+    for (int player = WHITE; player <= BLACK; player++)
+    {
+        entry->pawns[player] = 0;
+        entry->passed_pawns[player] = 0;
+        entry->half_open_files[player] = 0xFF;
+    }
+
+    uint64_t pieces = s->white_pieces | s->black_pieces;
+    while (pieces)
+    {
+        int i = pop_lsb(&pieces);
+        int piece = s->squares[i];
+        if (!is_pawn(piece))
+            continue;
+        int player = get_player(piece);
+
+        entry->pawns[player] = set_nth_bit_to(entry->pawns[player], i, 1);
+        entry->half_open_files[player] &= ~(1 << board_index_to_coord_x(i));
+    }
+
+    entry->score = 0;
+    for (int player = WHITE; player <= BLACK; player++)
+    {
+        uint64_t pawns = entry->pawns[player];
+        uint64_t opponent_pawns = entry->pawns[get_opponent(player)];
+        Score score = 0;
+        while (pawns)
+        {
+            int i = pop_lsb(&pawns);
+            if (pawn_front_span(player, i) & opponent_pawns)
+                continue;
+            entry->passed_pawns[player] = set_nth_bit_to(entry->passed_pawns[player], i, 1);
+            score += PASSED_PAWN(pawn_row(player, i));
+        }
+        score += count_isolated_pawns(entry, player) * ISOLATED_PAWN;
+        score += count_doubled_pawns(entry, player) * DOUBLED_PAWN;
+        entry->score += (player == WHITE) ? score : -score;
+    }
+}
+
+PawnEntry* probe_pawn_table(game_state* s)
+{
+    // returns the entry for the pawns of `s`, filling it in if it's not cached yet
+    n_pawn_table_probes++;
+    PawnEntry* entry = &pawn_table[s->pawn_hash & (PAWN_TABLE_SIZE - 1)];
+    if (entry->key == s->pawn_hash)
+    {
+        n_pawn_table_hits++;
+        return entry;
+    }
+    fill_pawn_entry(s, entry);
+    return entry;
+}
+
+#endif // PAWN_TABLE_H_
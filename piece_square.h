@@ -0,0 +1,84 @@
+#ifndef PIECE_SQUARE_H_
+#define PIECE_SQUARE_H_
+#include <stdint.h>
+
+#include "board.h"
+
+/*
+ * What every piece is worth on its own, and on each square
+ *
+ * Both only depend on the piece and its square, so the sums over the
+ * board are kept in the game_state and updated as the squares change
+ * in make_move_2 (a move changes at most four squares), instead of the
+ * evaluation adding up all 64 squares at every leaf
+ *
+ * Every value is a Score, a middlegame and an endgame value packed in one
+ * int, so both sums move with a single add. The evaluation blends the two
+ * by the game phase, which is kept the same way from the pieces left
+ *
+ * The tables are constant expressions, like the zobrist keys, so they
+ * need no initialization. The rows are indexed by the enum PIECES and
+ * then the square, BLANK and the unused value 7 are worth nothing
+ */
+
+// the endgame value in the high 16 bits, the middlegame one in the low 16,
+// the middlegame one is signed so it borrows from the endgame one when negative
+typedef int32_t Score;
+
+#define SCORE(mg, eg) ((Score) ((uint32_t) (eg) << 16) + (mg))
+
+int mg_value(Score s)
+{
+    return (int16_t) (uint16_t) s;
+}
+
+int eg_value(Score s)
+{
+    // undoes the borrow of a negative middlegame value
+    return (int16_t) (uint16_t) ((uint32_t) (s + 0x8000) >> 16);
+}
+
+// the weights that can be tuned, MATERIAL_*, PAWN_SPACE_ROW_* and the pawn
+// structure ones, see pawn_table.h
+#include "eval_weights.h"
+
+// the units are the eval's own, see eval_comprehensive. Pawns are worth
+// more once the pieces are off and they can run, the bishops and the rooks
+// get the open board, the knight loses some of its forks. Both kings are
+// always on the board, so theirs is never tuned
+#define MATERIAL_KING   SCORE(900, 900)
+
+const Score piece_material[14] = {
+    MATERIAL_ROOK, MATERIAL_KNIGHT, MATERIAL_BISHOP, MATERIAL_KING, MATERIAL_QUEEN, MATERIAL_PAWN, 0, 0,
+    -MATERIAL_ROOK, -MATERIAL_KNIGHT, -MATERIAL_BISHOP, -MATERIAL_KING, -MATERIAL_QUEEN, -MATERIAL_PAWN,
+};
+
+// the space a pawn covers grows with how far it has advanced: PAWN_SPACE_ROW_1
+// on its starting row up to PAWN_SPACE_ROW_6 a step from promoting, the rows
+// counted from the pawn's own side. Pawns are never on the first or last row
+#define PAWN_SPACE(row) \
+    ((row) == 1 ? PAWN_SPACE_ROW_1 : (row) == 2 ? PAWN_SPACE_ROW_2 : (row) == 3 ? PAWN_SPACE_ROW_3 : \
+     (row) == 4 ? PAWN_SPACE_ROW_4 : (row) == 5 ? PAWN_SPACE_ROW_5 : (row) == 6 ? PAWN_SPACE_ROW_6 : 0)
+#define PSQ_WHITE_PAWN(square) PAWN_SPACE(7 - (square) / 8)
+#define PSQ_BLACK_PAWN(square) (-PAWN_SPACE((square) / 8))
+
+#define PSQ_ROW_8(f, n) f(n), f((n)+1), f((n)+2), f((n)+3), f((n)+4), f((n)+5), f((n)+6), f((n)+7)
+#define PSQ_ROWS_64(f) \
+    PSQ_ROW_8(f, 0),  PSQ_ROW_8(f, 8),  PSQ_ROW_8(f, 16), PSQ_ROW_8(f, 24), \
+    PSQ_ROW_8(f, 32), PSQ_ROW_8(f, 40), PSQ_ROW_8(f, 48), PSQ_ROW_8(f, 56)
+
+const Score piece_square_values[14][64] = {
+    [W_PAWN] = {PSQ_ROWS_64(PSQ_WHITE_PAWN)},
+    [B_PAWN] = {PSQ_ROWS_64(PSQ_BLACK_PAWN)},
+};
+
+// how much of the middlegame is left: every minor piece counts 1, a rook 2
+// and a queen 4, so the starting position is PHASE_MAX and bare kings 0
+#define PHASE_MAX 24
+
+const uint8_t piece_phase[14] = {
+    [W_ROOK] = 2, [W_KNIGHT] = 1, [W_BISHOP] = 1, [W_QUEEN] = 4,
+    [B_ROOK] = 2, [B_KNIGHT] = 1, [B_BISHOP] = 1, [B_QUEEN] = 4,
+};
+
+#endif // PIECE_SQUARE_H_
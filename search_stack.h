@@ -0,0 +1,62 @@
+#ifndef SEARCH_STACK_H_
+#define SEARCH_STACK_H_
+#include <stdalign.h>
+
+#include "board.h"
+#include "legal_moves.h"
+#include "evaluation.h"
+
+/*
+ * The search stack holds everything a node of the search needs to keep
+ * around while its children are searched, one entry per ply
+ *
+ * A node used to put its move list (and the scores to sort it by) on the
+ * C stack, over a kilobyte per ply. Now the lists live here, allocated
+ * once per thread, so the recursion only keeps a few locals per ply and
+ * the entries stay put in the cache between visits to the same ply. Each
+ * entry starts on a cache line of its own
+ *
+ * Entry 0 is the root, choose_best_move's, a node at `ply` uses entry `ply`
+ */
+
+// the deepest the search can ever go, counting from the root
+#define MAX_PLY 128
+
+// no position has more legal moves than this
+#define MAX_MOVES 256
+
+typedef struct
+{
+    alignas(64) Move moves[MAX_MOVES];
+    // what the moves are sorted by
+    Value scores[MAX_MOVES];
+    // the last two quiet moves that caused a beta cutoff at this ply,
+    // they're likely to cause one in the sibling nodes too
+    Move killers[2];
+    // the static eval of the node, if it was needed
+    Value static_eval;
+} SearchStackEntry;
+
+// the quiescence search can run past the deepest ply of the main search
+_Thread_local SearchStackEntry search_stack[MAX_PLY + 1];
+
+void search_stack_clear()
+{
+    // the killers of the last search don't mean much in the next one
+    for (int ply = 0; ply <= MAX_PLY; ply++)
+    {
+        search_stack[ply].killers[0] = 0;
+        search_stack[ply].killers[1] = 0;
+    }
+}
+
+void search_stack_add_killer(int ply, Move m)
+{
+    SearchStackEntry* ss = &search_stack[ply];
+    if (ss->killers[0] == m)
+        return;
+    ss->killers[1] = ss->killers[0];
+    ss->killers[0] = m;
+}
+
+#endif // SEARCH_STACK_H_
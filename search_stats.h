@@ -0,0 +1,155 @@
+#ifndef SEARCH_STATS_H_
+#define SEARCH_STATS_H_
+#include <stdio.h>
+#include <stdint.h>
+
+#include "legal_moves.h"
+#include "evaluation.h"
+
+/*
+ * Statistics about how efficiently the search works, one set per
+ * iteration of the iterative deepening
+ *
+ * The search bumps the counters in search_counters as it goes, and
+ * choose_best_move files them away in search_stats at the end of
+ * every iteration. search_stats_write_json_lines then writes one
+ * JSON object per depth, so runs of different builds can be
+ * compared and charted
+ */
+
+typedef struct
+{
+    uint64_t nodes;
+    uint64_t quiescence_nodes;
+
+    // beta cutoffs, and how many of them came from the first move searched
+    uint64_t cutoffs;
+    uint64_t first_move_cutoffs;
+
+    uint64_t tt_probes;
+    uint64_t tt_hits;
+    uint64_t tt_cutoffs;
+
+    uint64_t eval_cache_probes;
+    uint64_t eval_cache_hits;
+    // evals that stopped before the mobility term, see evaluate_lazily
+    uint64_t lazy_evals;
+
+    uint64_t tb_probes;
+    uint64_t tb_hits;
+    uint64_t bitbase_hits;
+
+    uint64_t futility_pruned;
+    uint64_t reverse_futility_pruned;
+    uint64_t razored;
+    uint64_t late_move_pruned;
+    uint64_t mate_distance_pruned;
+} SearchCounters;
+
+// how many lines a multi-PV search can rank at the root, and how many moves of each it reports
+#define MAX_MULTIPV 16
+#define MAX_PV_LENGTH 16
+
+typedef struct
+{
+    Value value;
+    // the nodes searched under the first move of the line in this iteration
+    uint64_t nodes;
+    int length;
+    Move moves[MAX_PV_LENGTH];
+} SearchLine;
+
+typedef struct
+{
+    int depth;
+    SearchCounters counters;
+    // since the start of the search, not just this iteration
+    double time_milliseconds;
+    Move best_move;
+    Value value;
+    // the best lines at the root, best first, lines[0] is the one best_move starts
+    int n_lines;
+    SearchLine lines[MAX_MULTIPV];
+} SearchDepthStats;
+
+#define SEARCH_STATS_MAX_DEPTH 64
+
+typedef struct
+{
+    int n_depths;
+    SearchDepthStats depths[SEARCH_STATS_MAX_DEPTH];
+} SearchStats;
+
+SearchCounters search_counters;
+SearchStats search_stats;
+
+// if set, every search appends its statistics here
+FILE* search_stats_output = NULL;
+
+double ratio(uint64_t a, uint64_t b)
+{
+    return (b == 0) ? 0.0 : (double) a / (double) b;
+}
+
+void search_stats_write_json_lines(FILE* f, const SearchStats* stats)
+{
+    char uci[6];
+    for (int i = 0; i < stats->n_depths; i++)
+    {
+        const SearchDepthStats* d = &stats->depths[i];
+        const SearchCounters* c = &d->counters;
+
+        // effective branching factor: how many times more nodes
+        // this iteration took than the one before
+        double ebf = (i == 0) ? 0.0 : ratio(c->nodes, stats->depths[i-1].counters.nodes);
+        uint64_t nodes_so_far = 0;
+        for (int j = 0; j <= i; j++)
+            nodes_so_far += stats->depths[j].counters.nodes + stats->depths[j].counters.quiescence_nodes;
+        double nps = (d->time_milliseconds > 0) ? nodes_so_far * 1000.0 / d->time_milliseconds : 0.0;
+
+        move_to_uci(d->best_move, uci);
+        fprintf(f, "{\"depth\":%d,\"time_ms\":%.3f,\"nodes\":%llu,\"qnodes\":%llu,"
+                "\"nps\":%.0f,\"ebf\":%.3f,\"first_move_cutoff_rate\":%.4f,"
+                "\"tt_probes\":%llu,\"tt_hit_rate\":%.4f,\"tt_cut_rate\":%.4f,"
+                "\"eval_cache_probes\":%llu,\"eval_cache_hit_rate\":%.4f,\"lazy_evals\":%llu,"
+                "\"tb_probes\":%llu,\"tb_hits\":%llu,\"bitbase_hits\":%llu,"
+                "\"pruned\":{\"futility\":%llu,\"reverse_futility\":%llu,\"razoring\":%llu,"
+                "\"late_move\":%llu,\"mate_distance\":%llu},"
+                "\"best_move\":\"%s\",\"value\":%d",
+                d->depth, d->time_milliseconds,
+                (unsigned long long) c->nodes, (unsigned long long) c->quiescence_nodes,
+                nps, ebf, ratio(c->first_move_cutoffs, c->cutoffs),
+                (unsigned long long) c->tt_probes, ratio(c->tt_hits, c->tt_probes), ratio(c->tt_cutoffs, c->tt_probes),
+                (unsigned long long) c->eval_cache_probes, ratio(c->eval_cache_hits, c->eval_cache_probes),
+                (unsigned long long) c->lazy_evals,
+                (unsigned long long) c->tb_probes, (unsigned long long) c->tb_hits,
+                (unsigned long long) c->bitbase_hits,
+                (unsigned long long) c->futility_pruned, (unsigned long long) c->reverse_futility_pruned,
+                (unsigned long long) c->razored, (unsigned long long) c->late_move_pruned,
+                (unsigned long long) c->mate_distance_pruned,
+                uci, d->value);
+
+        // a multi-PV search reports all of its lines
+        if (d->n_lines > 1)
+        {
+            fprintf(f, ",\"multipv\":[");
+            for (int j = 0; j < d->n_lines; j++)
+            {
+                const SearchLine* line = &d->lines[j];
+                fprintf(f, "%s{\"value\":%d,\"nodes\":%llu,\"pv\":\"", (j == 0) ? "" : ",",
+                        line->value, (unsigned long long) line->nodes);
+                for (int k = 0; k < line->length; k++)
+                {
+                    move_to_uci(line->moves[k], uci);
+                    fprintf(f, (k == 0) ? "%s" : " %s", uci);
+                }
+                fprintf(f, "\"}");
+            }
+            fprintf(f, "]");
+        }
+        fprintf(f, "}\n");
+    }
+    fflush(f);
+}
+
+#endif // SEARCH_STATS_H_
@@ -0,0 +1,481 @@
+#ifndef TABLEBASE_H_
+#define TABLEBASE_H_
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "board.h"
+#include "legal_moves.h"
+
+/*
+ * Endgame tablebases, probed from files in a local directory
+ *
+ * These are the engine's own tables, written by tbgen, not Syzygy's: the
+ * compressed .rtbw and .rtbz files of a Syzygy directory can't be read, and
+ * tb_init only warns about them. There is one file per material signature,
+ * with the stronger side first: KRvK.ctb, KPvK.ctb, KBNvK.ctb and so on.
+ * tb_init only lists the directory, a file is mmapped the first time a
+ * position with its material is probed
+ *
+ * A file is a TBHeader followed by one byte per position, for the stronger
+ * side playing white. The byte is the result for the side to move:
+ *     0     a draw (or a position that can't come up)
+ *     d > 0 a win, d plies away from mate or from a capture or promotion
+ *           that leads into another table
+ *     d < 0 a loss, -d-1 plies away
+ * The engine doesn't keep a fifty move counter, so the distance is to mate
+ * or to the next conversion (DTC), not a distance to zeroing (DTZ), and the
+ * root moves are filtered by that. The files are written by tbgen, see
+ * tablebase_gen.h
+ *
+ * Positions are indexed by (side to move, stronger king, other pieces),
+ * reduced by the symmetries of the board: the stronger king is always on the
+ * a1-d1-d4 triangle, or on the a-d files if there are pawns
+ */
+
+#define TB_MAX_PIECES 4
+#define TB_MAX_TABLES 64
+#define TB_MAGIC 0x31425443 // "CTB1"
+
+enum TB_WDL { TB_LOSS = -1, TB_DRAW = 0, TB_WIN = 1 };
+enum TB_STATES { TB_NOT_LOADED, TB_LOADED, TB_MISSING };
+
+typedef struct
+{
+    uint32_t magic;
+    uint8_t n_pieces;
+    // the pieces in index order, the stronger side is white
+    char pieces[TB_MAX_PIECES];
+    uint8_t padding[7];
+} TBHeader;
+
+typedef struct
+{
+    char name[2 * TB_MAX_PIECES + 2];
+    atomic_int state;
+    int n_pieces;
+    int has_pawns;
+    char pieces[TB_MAX_PIECES];
+    uint64_t n_positions;
+    const int8_t* data;
+    size_t mapped_size;
+} Tablebase;
+
+char tb_path[1024] = "";
+Tablebase tablebases[TB_MAX_TABLES];
+int n_tablebases = 0;
+// the most pieces any table in tb_path has, no position with more gets probed
+int tb_max_pieces = 0;
+pthread_mutex_t tb_load_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// the order pieces are listed in, in the names and in the index
+const char tb_piece_letters[] = "KQRBNP";
+const int tb_piece_types[] = {W_KING, W_QUEEN, W_ROOK, W_BISHOP, W_KNIGHT, W_PAWN};
+const int tb_piece_values[] = {0, 9, 5, 3, 3, 1};
+
+// the slot of the stronger king for each square, -1 if it's outside the
+// reduced area, for tables without and with pawns
+int tb_king_slots[2][64];
+int tb_king_squares[2][32];
+int tb_n_king_slots[2] = {10, 32};
+int tb_king_slots_ready = 0;
+
+int tb_player_signature(game_state* s, int player, char* signature)
+{
+    // writes the pieces of `player`, like "KRP", and returns their value
+    int value = 0;
+    int n = 0;
+    for (int type = 0; type < 6; type++)
+    {
+        int piece = tb_piece_types[type] | (player == BLACK ? 8 : 0);
+        for (int i = 0; i < 64; i++)
+        {
+            if (s->squares[i] == piece)
+            {
+                signature[n++] = tb_piece_letters[type];
+                value += tb_piece_values[type];
+            }
+        }
+    }
+    signature[n] = '\0';
+    return value;
+}
+
+int tb_is_stronger(const char* a, int value_a, const char* b, int value_b)
+{
+    // returns 1 if the side with pieces `a` comes first in the table name
+    if (value_a != value_b)
+        return value_a > value_b;
+    for (int i = 0; a[i] && b[i]; i++)
+        if (a[i] != b[i])
+            return strchr(tb_piece_letters, a[i]) < strchr(tb_piece_letters, b[i]);
+    return strlen(a) >= strlen(b);
+}
+
+int tb_signature(game_state* s, char* name)
+{
+    // writes the table name for `s` and returns 1 if black is the stronger
+    // side, i.e. the board has to be flipped to look it up
+    char white[TB_MAX_PIECES + 1], black[TB_MAX_PIECES + 1];
+    int white_value = tb_player_signature(s, WHITE, white);
+    int black_value = tb_player_signature(s, BLACK, black);
+    int flip = !tb_is_stronger(white, white_value, black, black_value);
+    sprintf(name, "%sv%s", flip ? black : white, flip ? white : black);
+    return flip;
+}
+
+int tb_transform(int square, int symmetry)
+{
+    // one of the 8 symmetries of the board, bit 0 mirrors the files,
+    // bit 1 mirrors the ranks and bit 2 mirrors the a1-h8 diagonal
+    int x = board_index_to_coord_x(square);
+    int y = board_index_to_coord_y(square);
+    if (symmetry & 1)
+        x = 7 - x;
+    if (symmetry & 2)
+        y = 7 - y;
+    if (symmetry & 4)
+    {
+        int t = x;
+        x = y;
+        y = t;
+    }
+    return (7 - y) * 8 + x;
+}
+
+void tb_init_king_slots()
+{
+    if (tb_king_slots_ready)
+        return;
+    for (int pawns = 0; pawns < 2; pawns++)
+    {
+        int n = 0;
+        for (int y = 0; y < 8; y++)
+        {
+            for (int x = 0; x < 8; x++)
+            {
+                int square = (7 - y) * 8 + x;
+                int in_area = pawns ? (x <= 3) : (y <= x && x <= 3);
+                tb_king_slots[pawns][square] = in_area ? n : -1;
+                if (in_area)
+                    tb_king_squares[pawns][n++] = square;
+            }
+        }
+    }
+    tb_king_slots_ready = 1;
+}
+
+uint64_t tb_n_positions(int n_pieces, int has_pawns)
+{
+    uint64_t n = 2 * tb_n_king_slots[has_pawns];
+    for (int i = 1; i < n_pieces; i++)
+        n *= 64;
+    return n;
+}
+
+uint64_t tb_index(const Tablebase* tb, const int* squares, int turn)
+{
+    // the index of the position with the table's pieces on `squares`,
+    // the same for every position that is a mirror image of it
+    uint64_t best = UINT64_MAX;
+    int n_symmetries = tb->has_pawns ? 2 : 8;
+    for (int symmetry = 0; symmetry < n_symmetries; symmetry++)
+    {
+        // the stronger king comes first, and has to land in the reduced area
+        int king_slot = tb_king_slots[tb->has_pawns][tb_transform(squares[0], symmetry)];
+        if (king_slot == -1)
+            continue;
+        int sq[TB_MAX_PIECES];
+        for (int i = 1; i < tb->n_pieces; i++)
+            sq[i] = tb_transform(squares[i], symmetry);
+        // identical pieces are interchangeable, list them in order
+        for (int i = 2; i < tb->n_pieces; i++)
+            for (int j = i; j > 1 && tb->pieces[j] == tb->pieces[j-1] && sq[j] < sq[j-1]; j--)
+            {
+                int t = sq[j];
+                sq[j] = sq[j-1];
+                sq[j-1] = t;
+            }
+        uint64_t key = king_slot;
+        for (int i = 1; i < tb->n_pieces; i++)
+            key = key * 64 + sq[i];
+        if (key < best)
+            best = key;
+    }
+    return turn * (tb->n_positions / 2) + best;
+}
+
+int tb_parse_name(const char* name, Tablebase* tb)
+{
+    // fills in the pieces of the table called `name`, returns -1 if it isn't one
+    int n = 0;
+    int player = WHITE;
+    tb->has_pawns = 0;
+    for (const char* c = name; *c; c++)
+    {
+        if (*c == 'v' && player == WHITE)
+        {
+            player = BLACK;
+            continue;
+        }
+        const char* letter = strchr(tb_piece_letters, *c);
+        if (letter == NULL || n == TB_MAX_PIECES)
+            return -1;
+        int piece = tb_piece_types[letter - tb_piece_letters] | (player == BLACK ? 8 : 0);
+        if (is_pawn(piece))
+            tb->has_pawns = 1;
+        tb->pieces[n++] = piece;
+    }
+    // index order: the two kings, then the stronger side's pieces, then the other's
+    if (player != BLACK || n < 2 || tb->pieces[0] != W_KING)
+        return -1;
+    int black_king = 1;
+    while (black_king < n && tb->pieces[black_king] != B_KING)
+        black_king++;
+    if (black_king == n)
+        return -1;
+    for (int i = black_king; i > 1; i--)
+        tb->pieces[i] = tb->pieces[i-1];
+    tb->pieces[1] = B_KING;
+    tb->n_pieces = n;
+    tb->n_positions = tb_n_positions(n, tb->has_pawns);
+    strncpy(tb->name, name, sizeof(tb->name) - 1);
+    return 1;
+}
+
+Tablebase* tb_find(const char* name)
+{
+    for (int i = 0; i < n_tablebases; i++)
+        if (strcmp(tablebases[i].name, name) == 0)
+            return &tablebases[i];
+    return NULL;
+}
+
+int tb_init(const char* path)
+{
+    // lists the tables in `path`, can be called again to pick up new files
+    // returns the number of tables found, -1 if `path` can't be read
+    tb_init_king_slots();
+    DIR* dir = opendir(path);
+    if (dir == NULL)
+        return -1;
+    strncpy(tb_path, path, sizeof(tb_path) - 1);
+
+    struct dirent* file;
+    int n_syzygy_files = 0;
+    while ((file = readdir(dir)) != NULL && n_tablebases < TB_MAX_TABLES)
+    {
+        char name[64];
+        size_t length = strlen(file->d_name);
+        if (length > 5 && (strcmp(file->d_name + length - 5, ".rtbw") == 0
+                || strcmp(file->d_name + length - 5, ".rtbz") == 0))
+            n_syzygy_files++;
+        if (length < 5 || length >= sizeof(name) || strcmp(file->d_name + length - 4, ".ctb") != 0)
+            continue;
+        memcpy(name, file->d_name, length - 4);
+        name[length - 4] = '\0';
+        if (tb_find(name) != NULL)
+            continue;
+
+        Tablebase* tb = &tablebases[n_tablebases];
+        memset(tb, 0, sizeof(Tablebase));
+        if (tb_parse_name(name, tb) == -1)
+            continue;
+        atomic_init(&tb->state, TB_NOT_LOADED);
+        n_tablebases++;
+        if (tb->n_pieces > tb_max_pieces)
+            tb_max_pieces = tb->n_pieces;
+    }
+    closedir(dir);
+    if (n_syzygy_files > 0)
+        fprintf(stderr, "%s has %d Syzygy files, they can't be read, only the .ctb tables tbgen writes\n",
+                path, n_syzygy_files);
+    return n_tablebases;
+}
+
+int tb_load(Tablebase* tb)
+{
+    // mmaps the table's file, the first probe with its material does this
+    // returns 1 if the table can be probed
+    int state = atomic_load_explicit(&tb->state, memory_order_acquire);
+    if (state != TB_NOT_LOADED)
+        return state == TB_LOADED;
+
+    pthread_mutex_lock(&tb_load_lock);
+    if (atomic_load_explicit(&tb->state, memory_order_relaxed) == TB_NOT_LOADED)
+    {
+        state = TB_MISSING;
+        char file_name[sizeof(tb_path) + 32];
+        snprintf(file_name, sizeof(file_name), "%s/%s.ctb", tb_path, tb->name);
+        int fd = open(file_name, O_RDONLY);
+        struct stat st;
+        if (fd != -1 && fstat(fd, &st) == 0
+                && (uint64_t) st.st_size == sizeof(TBHeader) + tb->n_positions)
+        {
+            void* map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+            const TBHeader* header = (const TBHeader*) map;
+            if (map != MAP_FAILED && header->magic == TB_MAGIC && header->n_pieces == tb->n_pieces
+                    && memcmp(header->pieces, tb->pieces, tb->n_pieces) == 0)
+            {
+                tb->data = (const int8_t*) map + sizeof(TBHeader);
+                tb->mapped_size = st.st_size;
+                state = TB_LOADED;
+            } else if (map != MAP_FAILED) {
+                munmap(map, st.st_size);
+            }
+        }
+        if (fd != -1)
+            close(fd);
+        if (state == TB_MISSING)
+            fprintf(stderr, "tablebase %s can't be loaded\n", file_name);
+        atomic_store_explicit(&tb->state, state, memory_order_release);
+    }
+    pthread_mutex_unlock(&tb_load_lock);
+    return atomic_load_explicit(&tb->state, memory_order_acquire) == TB_LOADED;
+}
+
+void tb_free()
+{
+    for (int i = 0; i < n_tablebases; i++)
+        if (atomic_load(&tablebases[i].state) == TB_LOADED)
+            munmap((void*) (tablebases[i].data - sizeof(TBHeader)), tablebases[i].mapped_size);
+    n_tablebases = 0;
+    tb_max_pieces = 0;
+}
+
+int tb_squares_for_table(const Tablebase* tb, game_state* s, int flip, int* squares)
+{
+    // finds the table's pieces on the board of `s`, mirrored
+    // and with the colours swapped if `flip` is set
+    int filled = 0;
+    for (int i = 0; i < 64; i++)
+    {
+        int piece = s->squares[i];
+        if (is_blank(piece))
+            continue;
+        if (flip)
+            piece ^= 8;
+        for (int j = 0; j < tb->n_pieces; j++)
+        {
+            if (!(filled & (1 << j)) && tb->pieces[j] == piece)
+            {
+                squares[j] = flip ? (i ^ 56) : i;
+                filled |= 1 << j;
+                break;
+            }
+        }
+    }
+    return filled == (1 << tb->n_pieces) - 1;
+}
+
+int tb_decode(int8_t data, int* wdl, int* distance)
+{
+    if (data > 0)
+    {
+        *wdl = TB_WIN;
+        *distance = data;
+    } else if (data < 0) {
+        *wdl = TB_LOSS;
+        *distance = -data - 1;
+    } else {
+        *wdl = TB_DRAW;
+        *distance = 0;
+    }
+    return 1;
+}
+
+int tb_can_castle(game_state* s)
+{
+    // the tables have no castling, but the castle flags are only
+    // worth anything while the king and a rook are still at home
+    for (int player = WHITE; player <= BLACK; player++)
+    {
+        uint8_t castles = get_castle_status_for_player(s->castles_possible, player);
+        int king = (player == WHITE) ? W_KING : B_KING;
+        int rook = (player == WHITE) ? W_ROOK : B_ROOK;
+        if (s->squares[(player == WHITE) ? E1 : E8] != king)
+            continue;
+        for (int side = 0; side < 2; side++)
+            if (get_nth_bit(castles, side) && s->squares[rook_translations_castle_fr[player][side]] == rook)
+                return 1;
+    }
+    return 0;
+}
+
+int tb_probe(game_state* s, int* wdl, int* distance)
+{
+    /*
+     * looks `s` up in the tablebases
+     *
+     * returns 1 and sets `wdl` (from enum TB_WDL) and `distance` for the side to move
+     *         0 if no table covers `s`
+     */
+    if (tb_can_castle(s) || s->en_passant != -1)
+        return 0;
+    // the trivial draws don't need a table
+    int n_pieces = popcount(s->white_pieces | s->black_pieces);
+    if (n_pieces > tb_max_pieces && n_pieces > 3)
+        return 0;
+
+    char name[2 * TB_MAX_PIECES + 2];
+    int flip = tb_signature(s, name);
+    // a lone minor piece can't mate
+    if (strcmp(name, "KvK") == 0 || strcmp(name, "KBvK") == 0 || strcmp(name, "KNvK") == 0)
+        return tb_decode(0, wdl, distance);
+
+    Tablebase* tb = tb_find(name);
+    if (tb == NULL || !tb_load(tb))
+        return 0;
+    int squares[TB_MAX_PIECES];
+    if (!tb_squares_for_table(tb, s, flip, squares))
+        return 0;
+    int turn = flip ? get_opponent(s->turn) : s->turn;
+    return tb_decode(tb->data[tb_index(tb, squares, turn)], wdl, distance);
+}
+
+int tb_filter_root_moves(game_state* s, Move* moves, int n_moves)
+{
+    /*
+     * keeps only the root moves that the tables say are best: the ones that
+     * win fastest, or keep the draw, or lose slowest
+     *
+     * returns the number of moves left, which is `n_moves` if the tables
+     * don't cover every move
+     */
+    int wdl, distance;
+    if (!tb_probe(s, &wdl, &distance))
+        return n_moves;
+
+    int ranks[256];
+    int best_rank = -1000;
+    for (int i = 0; i < n_moves; i++)
+    {
+        game_state new_state = make_move_2(s, moves[i]);
+        if (!tb_probe(&new_state, &wdl, &distance))
+            return n_moves;
+        // the results are for the opponent
+        if (wdl == TB_LOSS)
+            ranks[i] = 500 - distance;
+        else if (wdl == TB_WIN)
+            ranks[i] = -500 + distance;
+        else
+            ranks[i] = 0;
+        if (ranks[i] > best_rank)
+            best_rank = ranks[i];
+    }
+
+    int n_kept = 0;
+    for (int i = 0; i < n_moves; i++)
+        if (ranks[i] == best_rank)
+            moves[n_kept++] = moves[i];
+    return n_kept;
+}
+
+#endif // TABLEBASE_H_
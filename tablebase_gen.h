@@ -0,0 +1,425 @@
+#ifndef TABLEBASE_GEN_H_
+#define TABLEBASE_GEN_H_
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdatomic.h>
+
+#include "board.h"
+#include "legal_moves.h"
+#include "tablebase.h"
+#include "bitbase.h"
+#include "thread_pool.h"
+
+/*
+ * Generates the tablebase files that tablebase.h probes, by retrograde analysis
+ *
+ * Every position of the table is set up and its moves generated with the
+ * usual move generator. Mates are lost at distance 0, and captures or
+ * promotions are looked up in the smaller tables, which have to be
+ * generated first. Then the results spread backwards one ply at a time:
+ * every position that can move into a lost one is won, and a position is
+ * lost once all of its moves lead into won ones. Whatever is left at the
+ * end is a draw
+ *
+ * To go backwards, the moves into a position are found by moving the
+ * pieces of the side that just moved back to where they could have come
+ * from. Only moves that stay inside the table (no captures or promotions)
+ * are needed, those always reverse the same way the pieces move
+ *
+ * Both steps run on a thread pool. Positions are only ever settled by
+ * whoever flips their status first, and each step settles a fixed distance,
+ * so the tables come out the same however the work gets split up
+ *
+ * Alongside the table, tbgen writes a bitbase: one bit per position, set if
+ * the stronger side wins. That's all there is to know about the endings
+ * where the weaker side has only the king, see bitbase.h
+ */
+
+enum TBGEN_STATUS { TBGEN_INVALID, TBGEN_UNKNOWN, TBGEN_RESOLVED };
+
+// the longest distance a table can hold
+#define TBGEN_MAX_DISTANCE 126
+
+typedef struct
+{
+    Tablebase tb;
+    // the results are bytes like the ones in the table files
+    atomic_schar* results;
+    atomic_uchar* status;
+    // the moves into other positions of the table that haven't been found to
+    // win for the opponent yet, a position is lost once this gets to 0
+    atomic_uchar* n_children_left;
+
+    // the distance the propagation is at, and how many positions it found there
+    int distance;
+    atomic_int n_settled;
+    atomic_int failed;
+} TBGenerator;
+
+int tbgen_decode(const Tablebase* tb, uint64_t index, game_state* s)
+{
+    // sets up the position at `index`
+    // returns 1 if it is a legal position, and `index` is its own index
+    uint64_t half = tb->n_positions / 2;
+    int turn = index / half;
+    uint64_t key = index % half;
+    int squares[TB_MAX_PIECES];
+    for (int i = tb->n_pieces - 1; i > 0; i--)
+    {
+        squares[i] = key % 64;
+        key /= 64;
+    }
+    squares[0] = tb_king_squares[tb->has_pawns][key];
+
+    memset(s, 0, sizeof(game_state));
+    memset(s->squares, BLANK, sizeof(s->squares));
+    for (int i = 0; i < tb->n_pieces; i++)
+    {
+        if (!is_blank(s->squares[squares[i]]))
+            return 0;
+        int y = board_index_to_coord_y(squares[i]);
+        if (is_pawn(tb->pieces[i]) && (y == 0 || y == 7))
+            return 0;
+        s->squares[squares[i]] = tb->pieces[i];
+    }
+    s->turn = turn;
+    s->castles_possible = 0;
+    s->en_passant = -1;
+    set_flags_new_state(s);
+
+    // the side that just moved can't be in check
+    int opponent_king = (turn == WHITE) ? B_KING : W_KING;
+    if (is_king_in_check(s, find_piece(s, opponent_king)))
+        return 0;
+    return tb_index(tb, squares, turn) == index;
+}
+
+uint64_t tbgen_index(const Tablebase* tb, game_state* s)
+{
+    int squares[TB_MAX_PIECES];
+    tb_squares_for_table(tb, s, 0, squares);
+    return tb_index(tb, squares, s->turn);
+}
+
+int tbgen_add_unique(uint64_t* indices, int n, uint64_t index)
+{
+    for (int i = 0; i < n; i++)
+        if (indices[i] == index)
+            return n;
+    indices[n] = index;
+    return n + 1;
+}
+
+int tbgen_add_predecessor(const Tablebase* tb, game_state* s, int from, int to, uint64_t* indices, int n)
+{
+    // adds the position before the piece on `to` came from `from`, if it is legal
+    game_state before = *s;
+    start_changes(&before, s->hash);
+    set_square(&before, from, before.squares[to]);
+    set_square(&before, to, BLANK);
+    before.turn = get_opponent(s->turn);
+    before.en_passant = -1;
+    set_bitboards_and_hashes(&before);
+    int king = (s->turn == WHITE) ? W_KING : B_KING;
+    if (is_king_in_check(&before, find_piece(&before, king)))
+        return n;
+    return tbgen_add_unique(indices, n, tbgen_index(tb, &before));
+}
+
+int tbgen_predecessors(const Tablebase* tb, game_state* s, uint64_t* indices)
+{
+    // finds the positions of the table that have a move into `s`
+    // returns how many there are
+    int n = 0;
+    int mover = get_opponent(s->turn);
+    uint64_t pieces = (mover == WHITE) ? s->white_pieces : s->black_pieces;
+    while (pieces)
+    {
+        int to = pop_lsb(&pieces);
+        int piece = s->squares[to];
+        int from;
+        if (is_knight(piece))
+        {
+            for (int vec = 0; vec < 8; vec++)
+            {
+                from = get_square_for_knight_vector(to, vec);
+                if (from != -1 && is_blank(s->squares[from]))
+                    n = tbgen_add_predecessor(tb, s, from, to, indices, n);
+            }
+        } else if (is_king(piece)) {
+            for (int dir = DIR_TOP; dir <= DIR_BOTTOM_RIGHT; dir++)
+            {
+                from = get_square_in_direction(to, dir, 1);
+                if (from != -1 && is_blank(s->squares[from]))
+                    n = tbgen_add_predecessor(tb, s, from, to, indices, n);
+            }
+        } else if (is_pawn(piece)) {
+            // pawns only go forwards, so they come from behind
+            int backwards = pawn_move_vectors[s->turn];
+            from = get_square_in_direction(to, backwards, 1);
+            if (from == -1 || !is_blank(s->squares[from]))
+                continue;
+            if (board_index_to_coord_y(from) != pawn_final_ranks[s->turn])
+                n = tbgen_add_predecessor(tb, s, from, to, indices, n);
+            if (board_index_to_coord_y(from) == pawn_initial_ranks[mover] + ((mover == WHITE) ? 1 : -1))
+            {
+                from = get_square_in_direction(to, backwards, 2);
+                if (is_blank(s->squares[from]))
+                    n = tbgen_add_predecessor(tb, s, from, to, indices, n);
+            }
+        } else {
+            int first_dir = is_bishop(piece) ? DIR_TOP_LEFT : DIR_TOP;
+            int last_dir = is_rook(piece) ? DIR_RIGHT : DIR_BOTTOM_RIGHT;
+            for (int dir = first_dir; dir <= last_dir; dir++)
+            {
+                for (int i = 1; ; i++)
+                {
+                    from = get_square_in_direction(to, dir, i);
+                    if (from == -1 || !is_blank(s->squares[from]))
+                        break;
+                    n = tbgen_add_predecessor(tb, s, from, to, indices, n);
+                }
+            }
+        }
+    }
+    return n;
+}
+
+void tbgen_settle(TBGenerator* g, uint64_t index, int8_t result)
+{
+    atomic_store_explicit(&g->results[index], result, memory_order_relaxed);
+    atomic_store_explicit(&g->status[index], TBGEN_RESOLVED, memory_order_relaxed);
+}
+
+int tbgen_set_up_position(TBGenerator* g, uint64_t index)
+{
+    /*
+     * generates the moves of the position at `index`, resolves it if it is
+     * a mate, a stalemate, or a capture or promotion decides it, and counts
+     * its moves into the table otherwise
+     *
+     * returns -1 if a capture or promotion leads into a table that isn't there
+     */
+    game_state s;
+    if (!tbgen_decode(&g->tb, index, &s))
+        return 1;
+    atomic_store_explicit(&g->status[index], TBGEN_UNKNOWN, memory_order_relaxed);
+
+    Move moves[256];
+    int n_moves = get_legal_moves_as_move_array(&s, moves);
+    if (n_moves == 0)
+    {
+        // checkmate is a loss at distance 0, stalemate a draw
+        int king = (s.turn == WHITE) ? W_KING : B_KING;
+        tbgen_settle(g, index, is_king_in_check(&s, find_piece(&s, king)) ? -1 : 0);
+        return 1;
+    }
+
+    uint64_t children[256];
+    int n_children = 0;
+    int n_drawn_conversions = 0;
+    int n_won_conversions = 0;
+    for (int i = 0; i < n_moves; i++)
+    {
+        game_state new_state = make_move_2(&s, moves[i]);
+        int captures = !is_blank(s.squares[get_to_bits(moves[i])]);
+        if (!captures && !get_promotion_bits(moves[i]))
+        {
+            n_children = tbgen_add_unique(children, n_children, tbgen_index(&g->tb, &new_state));
+            continue;
+        }
+        int wdl, distance;
+        if (!tb_probe(&new_state, &wdl, &distance))
+        {
+            char name[2 * TB_MAX_PIECES + 2];
+            tb_signature(&new_state, name);
+            if (!atomic_exchange(&g->failed, 1))
+                fprintf(stderr, "tbgen: %s needs the table %s\n", g->tb.name, name);
+            return -1;
+        }
+        if (wdl == TB_LOSS)
+            n_won_conversions++;
+        else if (wdl == TB_DRAW)
+            n_drawn_conversions++;
+    }
+
+    // a drawn conversion can never be used up, so the position is never lost
+    atomic_store_explicit(&g->n_children_left[index], n_children + (n_drawn_conversions ? 1 : 0), memory_order_relaxed);
+    if (n_won_conversions)
+        tbgen_settle(g, index, 1);
+    else if (n_children + n_drawn_conversions == 0)
+        // every move converts into a lost position
+        tbgen_settle(g, index, -2);
+    return 1;
+}
+
+void tbgen_set_up_positions(int begin, int end, void* arg)
+{
+    TBGenerator* g = (TBGenerator*) arg;
+    for (int i = begin; i < end && !atomic_load_explicit(&g->failed, memory_order_relaxed); i++)
+        tbgen_set_up_position(g, i);
+}
+
+int tbgen_distance(int8_t result)
+{
+    return (result > 0) ? result : -result - 1;
+}
+
+int tbgen_claim(TBGenerator* g, uint64_t index)
+{
+    // returns 1 if this thread gets to settle the position at `index`
+    unsigned char unknown = TBGEN_UNKNOWN;
+    return atomic_compare_exchange_strong(&g->status[index], &unknown, TBGEN_RESOLVED);
+}
+
+void tbgen_propagate(TBGenerator* g, uint64_t index)
+{
+    // the result at `index` is settled, pass it on to the moves into it
+    game_state s;
+    uint64_t predecessors[256 * TB_MAX_PIECES];
+    tbgen_decode(&g->tb, index, &s);
+    int8_t result = atomic_load_explicit(&g->results[index], memory_order_relaxed);
+    int distance = tbgen_distance(result);
+    int n = tbgen_predecessors(&g->tb, &s, predecessors);
+    for (int i = 0; i < n; i++)
+    {
+        uint64_t before = predecessors[i];
+        if (atomic_load_explicit(&g->status[before], memory_order_relaxed) != TBGEN_UNKNOWN)
+            continue;
+        if (result < 0)
+        {
+            if (tbgen_claim(g, before))
+                atomic_store_explicit(&g->results[before], distance + 1, memory_order_relaxed);
+        } else if (atomic_fetch_sub(&g->n_children_left[before], 1) == 1) {
+            if (tbgen_claim(g, before))
+                atomic_store_explicit(&g->results[before], -(distance + 1) - 1, memory_order_relaxed);
+        }
+    }
+}
+
+void tbgen_propagate_positions(int begin, int end, void* arg)
+{
+    // passes on the results settled at g->distance, the ones settled
+    // meanwhile are all further away and wait for the next round
+    TBGenerator* g = (TBGenerator*) arg;
+    int n_settled = 0;
+    for (int i = begin; i < end; i++)
+    {
+        if (atomic_load_explicit(&g->status[i], memory_order_relaxed) != TBGEN_RESOLVED)
+            continue;
+        int8_t result = atomic_load_explicit(&g->results[i], memory_order_relaxed);
+        if (result == 0 || tbgen_distance(result) != g->distance)
+            continue;
+        n_settled++;
+        tbgen_propagate(g, i);
+    }
+    atomic_fetch_add(&g->n_settled, n_settled);
+}
+
+int tbgen_write(const char* file_name, const Tablebase* tb, uint32_t magic, const void* data, size_t size)
+{
+    FILE* f = fopen(file_name, "wb");
+    TBHeader header;
+    memset(&header, 0, sizeof(header));
+    header.magic = magic;
+    header.n_pieces = tb->n_pieces;
+    memcpy(header.pieces, tb->pieces, tb->n_pieces);
+    int ret = 1;
+    if (f == NULL || fwrite(&header, sizeof(header), 1, f) != 1 || fwrite(data, 1, size, f) != size)
+    {
+        fprintf(stderr, "tbgen: can't write %s\n", file_name);
+        ret = -1;
+    }
+    if (f != NULL)
+        fclose(f);
+    return ret;
+}
+
+int tbgen_generate(ThreadPool* pool, const char* name, const char* path)
+{
+    /*
+     * generates the table `name` on `pool`, and writes it to `path`/`name`.ctb,
+     * along with its bitbase `path`/`name`.cbb if the weaker side can't win
+     * the tables its captures and promotions lead into have to be in `path` already
+     *
+     * returns 1 if the table was written, -1 if not
+     */
+    TBGenerator g;
+    memset(&g, 0, sizeof(g));
+    tb_init_king_slots();
+    if (tb_parse_name(name, &g.tb) == -1)
+    {
+        fprintf(stderr, "tbgen: %s isn't a table name\n", name);
+        return -1;
+    }
+    tb_init(path);
+
+    uint64_t n = g.tb.n_positions;
+    g.results = calloc(n, sizeof(atomic_schar));
+    g.status = calloc(n, sizeof(atomic_uchar));
+    g.n_children_left = calloc(n, sizeof(atomic_uchar));
+    atomic_init(&g.failed, 0);
+    thread_pool_parallel_for(pool, 0, n, 1024, &tbgen_set_up_positions, &g);
+    int ret = atomic_load(&g.failed) ? -1 : 1;
+
+    // the results settled at distance d settle the ones at d+1
+    int max_distance = 0;
+    for (g.distance = 0; ret == 1; g.distance++)
+    {
+        atomic_store(&g.n_settled, 0);
+        thread_pool_parallel_for(pool, 0, n, 4096, &tbgen_propagate_positions, &g);
+        if (atomic_load(&g.n_settled) == 0 && g.distance > 0)
+            break;
+        max_distance = g.distance;
+        if (g.distance == TBGEN_MAX_DISTANCE)
+        {
+            fprintf(stderr, "tbgen: %s has results further than %d plies away\n", name, TBGEN_MAX_DISTANCE);
+            ret = -1;
+        }
+    }
+
+    if (ret == 1)
+    {
+        int8_t* results = malloc(n);
+        uint8_t* bits = calloc((n + 7) / 8, 1);
+        uint64_t n_results[3] = {0, 0, 0};
+        int weaker_side_wins = 0;
+        for (uint64_t i = 0; i < n; i++)
+        {
+            // whatever is still unknown can't be won or lost
+            int status = atomic_load(&g.status[i]);
+            results[i] = (status == TBGEN_RESOLVED) ? atomic_load(&g.results[i]) : 0;
+            if (status != TBGEN_INVALID)
+                n_results[(results[i] > 0) - (results[i] < 0) + 1]++;
+
+            int white_to_move = i < n / 2;
+            if ((white_to_move && results[i] > 0) || (!white_to_move && results[i] < 0))
+                bits[i / 8] |= 1 << (i % 8);
+            if ((white_to_move && results[i] < 0) || (!white_to_move && results[i] > 0))
+                weaker_side_wins = 1;
+        }
+
+        char file_name[sizeof(tb_path) + 32];
+        snprintf(file_name, sizeof(file_name), "%s/%s.ctb", path, name);
+        ret = tbgen_write(file_name, &g.tb, TB_MAGIC, results, n);
+        if (ret == 1 && !weaker_side_wins)
+        {
+            snprintf(file_name, sizeof(file_name), "%s/%s.cbb", path, name);
+            ret = tbgen_write(file_name, &g.tb, BITBASE_MAGIC, bits, (n + 7) / 8);
+        }
+        if (ret == 1)
+            printf("%s: %llu won, %llu drawn, %llu lost, the furthest %d plies away%s\n", name,
+                    (unsigned long long) n_results[2], (unsigned long long) n_results[1],
+                    (unsigned long long) n_results[0], max_distance,
+                    weaker_side_wins ? ", no bitbase as the weaker side can win" : "");
+        free(results);
+        free(bits);
+    }
+    free(g.results);
+    free(g.status);
+    free(g.n_children_left);
+    return ret;
+}
+
+#endif // TABLEBASE_GEN_H_
@@ -0,0 +1,40 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+
+#include "board.h"
+#include "legal_moves.h"
+#include "tablebase.h"
+#include "tablebase_gen.h"
+#include "thread_pool.h"
+
+/*
+ * Generates endgame tablebases and bitbases into a directory, on all the cores
+ *
+ *   tbgen.out <directory> <table>...
+ *
+ * The tables are generated in the order given, and the ones that captures
+ * and promotions lead into have to come first, e.g.
+ *
+ *   tbgen.out tablebases KQvK KRvK KPvK KBNvK
+ */
+
+int main(int argc, char *argv[])
+{
+    if (argc < 3)
+    {
+        fprintf(stderr, "Usage: %s <directory> <table>...\n", argv[0]);
+        return 1;
+    }
+    mkdir(argv[1], 0755);
+    ThreadPool pool;
+    thread_pool_create(&pool, 0, 0);
+    int ret = 0;
+    for (int i = 2; i < argc && ret == 0; i++)
+    {
+        if (tbgen_generate(&pool, argv[i], argv[1]) == -1)
+            ret = 1;
+    }
+    thread_pool_destroy(&pool);
+    return ret;
+}
@@ -0,0 +1,426 @@
+#ifndef THREAD_POOL_H_
+#define THREAD_POOL_H_
+
+/*
+ * A work-stealing thread pool, shared by everything in the project
+ * that wants to run work concurrently
+ *
+ * Every worker owns a Chase-Lev deque. A worker pushes the tasks it
+ * submits to the bottom of its own deque and takes them back from
+ * the bottom (LIFO, so the data is still in its cache), while idle
+ * workers steal from the top of the others' deques (FIFO, so they
+ * take the biggest, oldest pieces of work).
+ * Tasks submitted from threads outside the pool (the GUI, a driver's
+ * main) go through a small mutex-protected injection queue instead.
+ *
+ * The unit of work is a Future, which the caller owns: submit it,
+ * then wait on it. Waiting doesn't block the thread, it runs other
+ * pending tasks until the future is done, so nested waits
+ * (like the ones in thread_pool_parallel_for) can't deadlock the pool.
+ *
+ * Needs -pthread, and _GNU_SOURCE for pinning the workers to cores.
+ */
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+// has to be a power of two
+#define WORK_STEALING_DEQUE_SIZE 4096
+#define THREAD_POOL_MAX_WORKERS 64
+
+// how many times an idle worker looks for work before going to sleep
+#define THREAD_POOL_SPINS_BEFORE_SLEEP 64
+
+typedef struct Future Future;
+
+struct Future
+{
+    void (*function)(void* arg);
+    void* arg;
+    atomic_int done;
+    // used by the injection queue
+    Future* next;
+};
+
+typedef struct
+{
+    atomic_long top;
+    atomic_long bottom;
+    _Atomic(Future*) buffer[WORK_STEALING_DEQUE_SIZE];
+} WorkStealingDeque;
+
+typedef struct ThreadPool ThreadPool;
+
+typedef struct
+{
+    // keep the deque ends of two workers off the same cache line
+    _Alignas(64) WorkStealingDeque deque;
+    pthread_t thread;
+    int index;
+    ThreadPool* pool;
+} Worker;
+
+struct ThreadPool
+{
+    int n_workers;
+    int pin_to_cores;
+    Worker* workers;
+
+    pthread_mutex_t lock;
+    pthread_cond_t wakeup;
+    Future* injected_head;
+    Future* injected_tail;
+    atomic_int n_injected;
+
+    // tasks that have been submitted but not started yet
+    atomic_int n_pending;
+    atomic_int n_sleeping;
+    atomic_int stop;
+};
+
+// which worker of which pool the current thread is, -1 outside the pool
+_Thread_local int thread_pool_worker_index = -1;
+_Thread_local ThreadPool* thread_pool_current = NULL;
+
+void deque_init(WorkStealingDeque* d)
+{
+    atomic_init(&d->top, 0);
+    atomic_init(&d->bottom, 0);
+    for (int i = 0; i < WORK_STEALING_DEQUE_SIZE; i++)
+        atomic_init(&d->buffer[i], NULL);
+}
+
+int deque_push(WorkStealingDeque* d, Future* f)
+{
+    // only ever called by the owner of the deque
+    // returns 0 if the deque is full
+    long b = atomic_load_explicit(&d->bottom, memory_order_relaxed);
+    long t = atomic_load_explicit(&d->top, memory_order_acquire);
+    if (b - t > WORK_STEALING_DEQUE_SIZE - 1)
+        return 0;
+    atomic_store_explicit(&d->buffer[b & (WORK_STEALING_DEQUE_SIZE - 1)], f, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    atomic_store_explicit(&d->bottom, b + 1, memory_order_relaxed);
+    return 1;
+}
+
+Future* deque_take(WorkStealingDeque* d)
+{
+    // only ever called by the owner of the deque, takes from the bottom
+    long b = atomic_load_explicit(&d->bottom, memory_order_relaxed) - 1;
+    atomic_store_explicit(&d->bottom, b, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    long t = atomic_load_explicit(&d->top, memory_order_relaxed);
+
+    Future* f = NULL;
+    if (t <= b)
+    {
+        f = atomic_load_explicit(&d->buffer[b & (WORK_STEALING_DEQUE_SIZE - 1)], memory_order_relaxed);
+        if (t == b)
+        {
+            // the last task, a thief might be after it too
+            if (!atomic_compare_exchange_strong_explicit(&d->top, &t, t + 1,
+                        memory_order_seq_cst, memory_order_relaxed))
+                f = NULL;
+            atomic_store_explicit(&d->bottom, b + 1, memory_order_relaxed);
+        }
+    } else {
+        atomic_store_explicit(&d->bottom, b + 1, memory_order_relaxed);
+    }
+    return f;
+}
+
+Future* deque_steal(WorkStealingDeque* d)
+{
+    // can be called from any thread, takes from the top
+    // returns NULL if the deque was empty or another thief won the race
+    long t = atomic_load_explicit(&d->top, memory_order_acquire);
+    atomic_thread_fence(memory_order_seq_cst);
+    long b = atomic_load_explicit(&d->bottom, memory_order_acquire);
+    if (t >= b)
+        return NULL;
+    Future* f = atomic_load_explicit(&d->buffer[t & (WORK_STEALING_DEQUE_SIZE - 1)], memory_order_relaxed);
+    if (!atomic_compare_exchange_strong_explicit(&d->top, &t, t + 1,
+                memory_order_seq_cst, memory_order_relaxed))
+        return NULL;
+    return f;
+}
+
+Future* thread_pool_pop_injected(ThreadPool* pool)
+{
+    if (atomic_load(&pool->n_injected) == 0)
+        return NULL;
+    pthread_mutex_lock(&pool->lock);
+    Future* f = pool->injected_head;
+    if (f != NULL)
+    {
+        pool->injected_head = f->next;
+        if (pool->injected_head == NULL)
+            pool->injected_tail = NULL;
+        atomic_fetch_sub(&pool->n_injected, 1);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return f;
+}
+
+Future* thread_pool_find_task(ThreadPool* pool)
+{
+    // looks for a task in the order: own deque, injected tasks, other deques
+    Future* f = NULL;
+    int self = (thread_pool_current == pool) ? thread_pool_worker_index : -1;
+
+    if (self != -1)
+        f = deque_take(&pool->workers[self].deque);
+    if (f == NULL)
+        f = thread_pool_pop_injected(pool);
+    for (int i = 1; f == NULL && i <= pool->n_workers; i++)
+    {
+        int victim = (self + i) % pool->n_workers;
+        if (victim < 0 || victim == self)
+            continue;
+        f = deque_steal(&pool->workers[victim].deque);
+    }
+    if (f != NULL)
+        atomic_fetch_sub(&pool->n_pending, 1);
+    return f;
+}
+
+void future_run(Future* f)
+{
+    f->function(f->arg);
+    atomic_store_explicit(&f->done, 1, memory_order_release);
+}
+
+int thread_pool_run_pending_task(ThreadPool* pool)
+{
+    // runs one pending task on the calling thread
+    // returns 0 if there was nothing to run
+    Future* f = thread_pool_find_task(pool);
+    if (f == NULL)
+        return 0;
+    future_run(f);
+    return 1;
+}
+
+void thread_pool_wake_workers(ThreadPool* pool)
+{
+    if (atomic_load(&pool->n_sleeping) == 0)
+        return;
+    pthread_mutex_lock(&pool->lock);
+    pthread_cond_signal(&pool->wakeup);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+void thread_pool_pin_to_core(int core)
+{
+#if defined(__linux__) && defined(_GNU_SOURCE)
+    long n_cores = sysconf(_SC_NPROCESSORS_ONLN);
+    if (n_cores < 1)
+        return;
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(core % n_cores, &cpus);
+    pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &cpus);
+#else
+    (void) core;
+#endif
+}
+
+void* thread_pool_worker_main(void* arg)
+{
+    Worker* w = (Worker*) arg;
+    ThreadPool* pool = w->pool;
+    thread_pool_worker_index = w->index;
+    thread_pool_current = pool;
+
+    if (pool->pin_to_cores)
+        thread_pool_pin_to_core(w->index);
+
+    int idle_spins = 0;
+    while (!atomic_load(&pool->stop))
+    {
+        if (thread_pool_run_pending_task(pool))
+        {
+            idle_spins = 0;
+            continue;
+        }
+        if (++idle_spins < THREAD_POOL_SPINS_BEFORE_SLEEP)
+        {
+            sched_yield();
+            continue;
+        }
+        // n_sleeping goes up before n_pending is checked, and submitters
+        // bump n_pending before they check n_sleeping, so one of the
+        // two always sees the other and no wakeup gets lost
+        pthread_mutex_lock(&pool->lock);
+        atomic_fetch_add(&pool->n_sleeping, 1);
+        while (atomic_load(&pool->n_pending) == 0 && !atomic_load(&pool->stop))
+            pthread_cond_wait(&pool->wakeup, &pool->lock);
+        atomic_fetch_sub(&pool->n_sleeping, 1);
+        pthread_mutex_unlock(&pool->lock);
+        idle_spins = 0;
+    }
+    return NULL;
+}
+
+int thread_pool_default_n_workers()
+{
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    if (n < 1)
+        n = 1;
+    if (n > THREAD_POOL_MAX_WORKERS)
+        n = THREAD_POOL_MAX_WORKERS;
+    return (int) n;
+}
+
+int thread_pool_create(ThreadPool* pool, int n_workers, int pin_to_cores)
+{
+    /*
+     * Starts `n_workers` workers, or one per core if n_workers is 0
+     *
+     * returns 1 if the pool was started
+     *        -1 if the workers couldn't be allocated or started
+     */
+    if (n_workers <= 0)
+        n_workers = thread_pool_default_n_workers();
+    if (n_workers > THREAD_POOL_MAX_WORKERS)
+        n_workers = THREAD_POOL_MAX_WORKERS;
+
+    pool->n_workers = n_workers;
+    pool->pin_to_cores = pin_to_cores;
+    pool->injected_head = NULL;
+    pool->injected_tail = NULL;
+    atomic_init(&pool->n_injected, 0);
+    atomic_init(&pool->n_pending, 0);
+    atomic_init(&pool->n_sleeping, 0);
+    atomic_init(&pool->stop, 0);
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->wakeup, NULL);
+
+    if (posix_memalign((void**) &pool->workers, 64, n_workers * sizeof(Worker)) != 0)
+        return -1;
+    for (int i = 0; i < n_workers; i++)
+    {
+        deque_init(&pool->workers[i].deque);
+        pool->workers[i].index = i;
+        pool->workers[i].pool = pool;
+    }
+    for (int i = 0; i < n_workers; i++)
+    {
+        if (pthread_create(&pool->workers[i].thread, NULL, &thread_pool_worker_main, &pool->workers[i]) != 0)
+        {
+            fprintf(stderr, "Couldn't start worker %d of the thread pool.\n", i);
+            pool->n_workers = i;
+            return -1;
+        }
+    }
+    return 1;
+}
+
+void thread_pool_destroy(ThreadPool* pool)
+{
+    // the pending tasks are dropped, wait on them first if they matter
+    pthread_mutex_lock(&pool->lock);
+    atomic_store(&pool->stop, 1);
+    pthread_cond_broadcast(&pool->wakeup);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (int i = 0; i < pool->n_workers; i++)
+        pthread_join(pool->workers[i].thread, NULL);
+    free(pool->workers);
+    pool->workers = NULL;
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->wakeup);
+}
+
+void thread_pool_submit(ThreadPool* pool, Future* f, void (*function)(void* arg), void* arg)
+{
+    // schedules function(arg), `f` has to stay alive until it is done
+    f->function = function;
+    f->arg = arg;
+    f->next = NULL;
+    atomic_store_explicit(&f->done, 0, memory_order_relaxed);
+
+    atomic_fetch_add(&pool->n_pending, 1);
+    if (thread_pool_current == pool
+            && deque_push(&pool->workers[thread_pool_worker_index].deque, f))
+    {
+        thread_pool_wake_workers(pool);
+        return;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    if (pool->injected_tail == NULL)
+        pool->injected_head = f;
+    else
+        pool->injected_tail->next = f;
+    pool->injected_tail = f;
+    atomic_fetch_add(&pool->n_injected, 1);
+    pthread_cond_signal(&pool->wakeup);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+int future_is_ready(Future* f)
+{
+    return atomic_load_explicit(&f->done, memory_order_acquire);
+}
+
+void future_wait(ThreadPool* pool, Future* f)
+{
+    // joins `f`, running other pending tasks while it isn't done yet
+    while (!future_is_ready(f))
+    {
+        if (!thread_pool_run_pending_task(pool))
+            sched_yield();
+    }
+}
+
+typedef struct
+{
+    ThreadPool* pool;
+    int begin;
+    int end;
+    int grain;
+    void (*body)(int begin, int end, void* arg);
+    void* arg;
+} ParallelForRange;
+
+void parallel_for_task(void* arg)
+{
+    // splits the range in halves, hands one half to whoever wants to
+    // steal it and keeps working on the other one
+    ParallelForRange* range = (ParallelForRange*) arg;
+    if (range->end - range->begin <= range->grain)
+    {
+        range->body(range->begin, range->end, range->arg);
+        return;
+    }
+    int middle = range->begin + (range->end - range->begin) / 2;
+    ParallelForRange upper = *range;
+    ParallelForRange lower = *range;
+    upper.begin = middle;
+    lower.end = middle;
+
+    Future upper_future;
+    thread_pool_submit(range->pool, &upper_future, &parallel_for_task, &upper);
+    parallel_for_task(&lower);
+    future_wait(range->pool, &upper_future);
+}
+
+void thread_pool_parallel_for(ThreadPool* pool, int begin, int end, int grain,
+        void (*body)(int begin, int end, void* arg), void* arg)
+{
+    // calls body on chunks of [begin, end) no bigger than `grain`,
+    // spread over the pool, and returns once all of them are done
+    if (grain < 1)
+        grain = 1;
+    ParallelForRange range = {pool, begin, end, grain, body, arg};
+    parallel_for_task(&range);
+}
+
+#endif // THREAD_POOL_H_
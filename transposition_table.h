@@ -0,0 +1,84 @@
+#ifndef TRANSPOSITION_TABLE_H_
+#define TRANSPOSITION_TABLE_H_
+#include <stdint.h>
+
+#include "board.h"
+#include "legal_moves.h"
+#include "evaluation.h"
+
+/*
+ * A direct-mapped transposition table, indexed by the low bits of the
+ * zobrist hash of a game_state
+ *
+ * Each entry remembers what the search learnt about a state: its value
+ * (which might only be a bound), the depth it was searched to, and the
+ * best move it found, which is the first move to try the next time
+ * the state comes up
+ */
+
+// has to be a power of two, 2^20 entries is 12MB
+#define TT_SIZE (1 << 20)
+
+enum BOUNDS {
+    BOUND_NONE,
+    BOUND_UPPER, // the value failed low, the real value is at most this
+    BOUND_LOWER, // the value failed high, the real value is at least this
+    BOUND_EXACT
+};
+
+typedef struct
+{
+    uint32_t key; // the high 32 bits of the hash, the low ones are the index
+    Value value;
+    Move move;
+    int8_t depth;
+    uint8_t bound : 2;
+    uint8_t generation : 6;
+} TTEntry;
+
+TTEntry transposition_table[TT_SIZE];
+
+// bumped once per search, so entries left over from old searches get replaced first
+uint8_t tt_generation = 0;
+
+void tt_new_search()
+{
+    tt_generation = (tt_generation + 1) & 0b111111;
+}
+
+void tt_clear()
+{
+    memset(transposition_table, 0, sizeof(transposition_table));
+    tt_generation = 0;
+}
+
+TTEntry* tt_probe(uint64_t hash)
+{
+    // returns the entry for `hash`, or NULL if the table has nothing on it
+    TTEntry* entry = &transposition_table[hash & (TT_SIZE - 1)];
+    if (entry->bound == BOUND_NONE || entry->key != (uint32_t) (hash >> 32))
+        return NULL;
+    return entry;
+}
+
+void tt_store(uint64_t hash, Value value, Move move, int depth, int bound)
+{
+    TTEntry* entry = &transposition_table[hash & (TT_SIZE - 1)];
+    uint32_t key = (uint32_t) (hash >> 32);
+
+    // a deeper result for the same state from this search is worth more
+    if (entry->key == key && entry->generation == tt_generation && entry->depth > depth)
+        return;
+    // keep the old best move if the new result doesn't have one
+    if (move == 0 && entry->key == key)
+        move = entry->move;
+
+    entry->key = key;
+    entry->value = value;
+    entry->move = move;
+    entry->depth = depth;
+    entry->bound = bound;
+    entry->generation = tt_generation;
+}
+
+#endif // TRANSPOSITION_TABLE_H_
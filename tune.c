@@ -0,0 +1,73 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "tuner.h"
+#include "thread_pool.h"
+
+/*
+ * Tunes the classical evaluation on labelled positions, on all the cores
+ *
+ *   tune.out <positions.epd> [epochs [weights file]]
+ *
+ * and writes the weights, to eval_weights.h unless told otherwise, after
+ * every epoch. Rebuild with the new file to use them
+ */
+
+double tune_seconds()
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc < 2)
+    {
+        fprintf(stderr, "Usage: %s <positions.epd> [epochs [weights file]]\n", argv[0]);
+        return 1;
+    }
+    int n_epochs = (argc > 2) ? atoi(argv[2]) : 100;
+    const char* weights_file = (argc > 3) ? argv[3] : "eval_weights.h";
+
+    ThreadPool pool;
+    thread_pool_create(&pool, 0, 0);
+    Tuner tuner;
+    tuner_init(&tuner, &pool);
+
+    double t1 = tune_seconds();
+    if (tuner_load(&tuner, argv[1]) <= 0)
+    {
+        fprintf(stderr, "tune: no labelled positions in %s\n", argv[1]);
+        thread_pool_destroy(&pool);
+        return 1;
+    }
+    tuner_shuffle(&tuner);
+    double t2 = tune_seconds();
+    printf("loaded %d positions in %.1fs, %d workers\n", tuner.n_positions, t2 - t1, pool.n_workers);
+
+    tuner_fit_k(&tuner);
+    double start_loss = tuner_loss(&tuner);
+    printf("K %.3f, loss %.6f\n", tuner.k, start_loss);
+
+    int ret = 0;
+    for (int epoch = 1; epoch <= n_epochs && ret == 0; epoch++)
+    {
+        t1 = tune_seconds();
+        tuner_epoch(&tuner);
+        double loss = tuner_loss(&tuner);
+        t2 = tune_seconds();
+        printf("epoch %3d loss %.6f %.2fs\n", epoch, loss, t2 - t1);
+        fflush(stdout);
+
+        char comment[256];
+        snprintf(comment, sizeof(comment), "%d positions from %s,\n * %d epochs, K %.3f, loss %.6f down from %.6f",
+                tuner.n_positions, argv[1], epoch, tuner.k, loss, start_loss);
+        if (tuner_write_weights(&tuner, weights_file, comment) == -1)
+            ret = 1;
+    }
+    tuner_free(&tuner);
+    thread_pool_destroy(&pool);
+    return ret;
+}
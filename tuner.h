@@ -0,0 +1,568 @@
+#ifndef TUNER_H_
+#define TUNER_H_
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+
+#include "board.h"
+#include "legal_moves.h"
+#include "evaluation.h"
+#include "thread_pool.h"
+
+/*
+ * Tunes the weights in eval_weights.h on positions labelled with the result
+ * of the game they were played in (Texel's method)
+ *
+ * The eval maps to an expected result through a sigmoid, 1 / (1 + 10^(-K e / 400)),
+ * with K fitted to the starting weights first, and the weights follow the
+ * gradient of the mean squared error between that and the actual results,
+ * with Adam, over shuffled batches of positions
+ *
+ * The classical eval is a sum of weights times things about the position
+ * that don't depend on the weights: how many pieces of each kind either side
+ * has, how many pawns it has on every row, how many passed pawns on every
+ * row and isolated and doubled pawns (see pawn_table.h), the game phase,
+ * and the squares each piece can move to. So when a position is loaded it's
+ * boiled down to those once, in a TunerPosition of 40 bytes, and an epoch
+ * is only arithmetic on them, split over the thread pool. Ten million
+ * positions take 400MB
+ *
+ * The positions are read from EPD or FEN lines with the result somewhere
+ * after the board: 1-0, 0-1 or 1/2-1/2 (as in c9 "1-0";), or [1.0], [0.5]
+ * or [0.0]. Lines without one are skipped
+ */
+
+// the first parameter of each group, the material, space and pawn
+// structure ones are a middlegame and an endgame value for each of pawn,
+// knight, bishop, rook and queen, for each of the pawn rows 1 to 6, for
+// each of the passed pawn rows 1 to 6, and for isolated and doubled pawns
+enum TUNER_PARAMS {
+    TP_MATERIAL = 0,
+    TP_SPACE = 10,
+    TP_PASSED = 22,
+    TP_ISOLATED = 34,
+    TP_DOUBLED = 36,
+    TP_KNIGHT_MOB = 38, TP_BISHOP_MOB, TP_ROOK_MOB, TP_QUEEN_MOB,
+    TP_MG_MOBILITY, TP_EG_MOBILITY,
+    TP_N_PARAMS
+};
+
+// pieces with more mobility entries than this are promotions gone wild,
+// those positions are skipped
+#define TUNER_MAX_MOBILITY 18
+
+typedef struct
+{
+    // white's minus black's: pawns, knights, bishops, rooks, queens
+    int8_t material[5];
+    // white's minus black's pawns on each row, counted from their own side, 1 to 6
+    int8_t pawn_rows[6];
+    // the same for the passed pawns, then the isolated and the doubled ones
+    int8_t passed_rows[6];
+    int8_t isolated;
+    int8_t doubled;
+    uint8_t phase;
+    // 0 if black won, 1 for a draw, 2 if white won
+    uint8_t result;
+    uint8_t n_mobility;
+    // (count << 3) | (player << 2) | kind, the kind 0 to 3 for knight to queen
+    uint8_t mobility[TUNER_MAX_MOBILITY];
+} TunerPosition;
+
+typedef struct
+{
+    TunerPosition* positions;
+    int n_positions;
+    int capacity;
+
+    double params[TP_N_PARAMS];
+    // how far Adam moves each parameter in a step, about
+    double step[TP_N_PARAMS];
+    double adam_m[TP_N_PARAMS];
+    double adam_v[TP_N_PARAMS];
+    int adam_t;
+    double k;
+    int batch_size;
+
+    // the mobility terms and their derivatives by the parameter for every
+    // kind and count, worked out once per step
+    double mobility_value[4][MOBILITY_COUNTS];
+    double mobility_slope[4][MOBILITY_COUNTS];
+
+    ThreadPool* pool;
+} Tuner;
+
+// the positions in a batch are split into chunks of this size
+// for the pool, each with its own sums
+#define TUNER_CHUNK 4096
+
+void tuner_init(Tuner* t, ThreadPool* pool)
+{
+    // starts from the weights this was built with
+    memset(t, 0, sizeof(Tuner));
+    t->pool = pool;
+    t->batch_size = 1 << 16;
+    const Score material[5] = {MATERIAL_PAWN, MATERIAL_KNIGHT, MATERIAL_BISHOP, MATERIAL_ROOK, MATERIAL_QUEEN};
+    for (int i = 0; i < 5; i++)
+    {
+        t->params[TP_MATERIAL + 2 * i] = mg_value(material[i]);
+        t->params[TP_MATERIAL + 2 * i + 1] = eg_value(material[i]);
+        t->step[TP_MATERIAL + 2 * i] = t->step[TP_MATERIAL + 2 * i + 1] = 0.5;
+    }
+    for (int row = 1; row <= 6; row++)
+    {
+        t->params[TP_SPACE + 2 * (row - 1)] = mg_value(PAWN_SPACE(row));
+        t->params[TP_SPACE + 2 * (row - 1) + 1] = eg_value(PAWN_SPACE(row));
+        t->step[TP_SPACE + 2 * (row - 1)] = t->step[TP_SPACE + 2 * (row - 1) + 1] = 0.2;
+        t->params[TP_PASSED + 2 * (row - 1)] = mg_value(PASSED_PAWN(row));
+        t->params[TP_PASSED + 2 * (row - 1) + 1] = eg_value(PASSED_PAWN(row));
+        t->step[TP_PASSED + 2 * (row - 1)] = t->step[TP_PASSED + 2 * (row - 1) + 1] = 0.2;
+    }
+    t->params[TP_ISOLATED] = mg_value(ISOLATED_PAWN);
+    t->params[TP_ISOLATED + 1] = eg_value(ISOLATED_PAWN);
+    t->params[TP_DOUBLED] = mg_value(DOUBLED_PAWN);
+    t->params[TP_DOUBLED + 1] = eg_value(DOUBLED_PAWN);
+    t->step[TP_ISOLATED] = t->step[TP_ISOLATED + 1] = t->step[TP_DOUBLED] = t->step[TP_DOUBLED + 1] = 0.2;
+    t->params[TP_KNIGHT_MOB] = KNIGHT_MOB_VAL;
+    t->params[TP_BISHOP_MOB] = BISHOP_MOB_VAL;
+    t->params[TP_ROOK_MOB] = ROOK_MOB_VAL;
+    t->params[TP_QUEEN_MOB] = QUEEN_MOB_VAL;
+    t->params[TP_MG_MOBILITY] = MG_MOBILITY_WEIGHT;
+    t->params[TP_EG_MOBILITY] = EG_MOBILITY_WEIGHT;
+    t->step[TP_KNIGHT_MOB] = 0.01;
+    t->step[TP_BISHOP_MOB] = t->step[TP_ROOK_MOB] = t->step[TP_QUEEN_MOB] = 0.001;
+    t->step[TP_MG_MOBILITY] = t->step[TP_EG_MOBILITY] = 0.002;
+}
+
+int tuner_parse_result(const char* text)
+{
+    // returns the result in a TunerPosition, -1 if there isn't one
+    if (strstr(text, "1/2-1/2") || strstr(text, "[0.5]"))
+        return 1;
+    if (strstr(text, "1-0") || strstr(text, "[1.0]"))
+        return 2;
+    if (strstr(text, "0-1") || strstr(text, "[0.0]"))
+        return 0;
+    return -1;
+}
+
+int tuner_encode(const char* line, TunerPosition* p)
+{
+    /*
+     * Boils the position on an EPD line down to what the weights multiply
+     *
+     * returns 1 if the line has a position and a result
+     *        -1 if it doesn't, or has too many pieces to keep
+     */
+    // read_state trusts the board to be well-formed, so check it first
+    int n_squares = 0, n_rows = 1;
+    const char* c = line;
+    for (; *c && *c != ' '; c++)
+    {
+        if (*c >= '1' && *c <= '8')
+            n_squares += *c - '0';
+        else if (*c == '/')
+            n_rows++;
+        else if (strchr("rnbkqpRNBKQP", *c))
+            n_squares++;
+        else
+            return -1;
+    }
+    if (n_squares != 64 || n_rows != 8 || *c != ' ')
+        return -1;
+    int result = tuner_parse_result(c);
+    if (result == -1)
+        return -1;
+
+    game_state s;
+    memset(&s, 0, sizeof(game_state));
+    if (read_state(&s, (char*) line) == -1)
+        return -1;
+    set_flags_new_state(&s);
+
+    memset(p, 0, sizeof(TunerPosition));
+    p->result = result;
+    p->phase = game_phase(&s);
+    for (int i = 0; i < 64; i++)
+    {
+        int piece = s.squares[i];
+        if (is_blank(piece) || is_king(piece))
+            continue;
+        int sign = (get_player(piece) == WHITE) ? 1 : -1;
+        if (is_pawn(piece))
+        {
+            p->material[0] += sign;
+            int row = (sign == 1) ? 7 - i / 8 : i / 8;
+            if (row >= 1 && row <= 6)
+                p->pawn_rows[row - 1] += sign;
+            continue;
+        }
+        int kind = is_knight(piece) ? 0 : is_bishop(piece) ? 1 : is_rook(piece) ? 2 : 3;
+        p->material[kind + 1] += sign;
+        if (p->n_mobility == TUNER_MAX_MOBILITY)
+            return -1;
+        p->mobility[p->n_mobility++] = (piece_mobility(&s, i) << 3) | ((sign == -1) << 2) | kind;
+    }
+
+    // counted from the masks the pawn table scores them by
+    PawnEntry pawns;
+    fill_pawn_entry(&s, &pawns);
+    for (int player = WHITE; player <= BLACK; player++)
+    {
+        int sign = (player == WHITE) ? 1 : -1;
+        uint64_t passed = pawns.passed_pawns[player];
+        while (passed)
+        {
+            int row = pawn_row(player, pop_lsb(&passed));
+            if (row >= 1 && row <= 6)
+                p->passed_rows[row - 1] += sign;
+        }
+        p->isolated += sign * count_isolated_pawns(&pawns, player);
+        p->doubled += sign * count_doubled_pawns(&pawns, player);
+    }
+    return 1;
+}
+
+void tuner_prepare_mobility(Tuner* t)
+{
+    // the knights count linearly, the sliders exponentially,
+    // see eval_major_pieces_mobility
+    for (int count = 0; count < MOBILITY_COUNTS; count++)
+    {
+        t->mobility_value[0][count] = t->params[TP_KNIGHT_MOB] * count;
+        t->mobility_slope[0][count] = count;
+        for (int kind = 1; kind < 4; kind++)
+        {
+            double base = t->params[TP_KNIGHT_MOB + kind];
+            t->mobility_value[kind][count] = pow(base, count);
+            t->mobility_slope[kind][count] = count ? count * pow(base, count - 1) : 0;
+        }
+    }
+}
+
+double tuner_evaluate(const Tuner* t, const TunerPosition* p, double* mobility)
+{
+    // the eval eval_comprehensive gives the position, in centipawns,
+    // before it's rounded. Also returns the mobility term
+    const double* w = t->params;
+    double mg = 0, eg = 0, mob = 0;
+    for (int i = 0; i < 5; i++)
+    {
+        mg += MATERIAL_WEIGHT * w[TP_MATERIAL + 2 * i] * p->material[i];
+        eg += MATERIAL_WEIGHT * w[TP_MATERIAL + 2 * i + 1] * p->material[i];
+    }
+    for (int i = 0; i < 6; i++)
+    {
+        mg += SPACE_WEIGHT * w[TP_SPACE + 2 * i] * p->pawn_rows[i];
+        eg += SPACE_WEIGHT * w[TP_SPACE + 2 * i + 1] * p->pawn_rows[i];
+        mg += MATERIAL_WEIGHT * w[TP_PASSED + 2 * i] * p->passed_rows[i];
+        eg += MATERIAL_WEIGHT * w[TP_PASSED + 2 * i + 1] * p->passed_rows[i];
+    }
+    mg += MATERIAL_WEIGHT * (w[TP_ISOLATED] * p->isolated + w[TP_DOUBLED] * p->doubled);
+    eg += MATERIAL_WEIGHT * (w[TP_ISOLATED + 1] * p->isolated + w[TP_DOUBLED + 1] * p->doubled);
+    for (int i = 0; i < p->n_mobility; i++)
+    {
+        int entry = p->mobility[i];
+        double value = t->mobility_value[entry & 3][entry >> 3];
+        mob += (entry & 4) ? -value : value;
+    }
+    mg += w[TP_MG_MOBILITY] * mob;
+    eg += w[TP_EG_MOBILITY] * mob;
+    *mobility = mob;
+    return (mg * p->phase + eg * (PHASE_MAX - p->phase)) / PHASE_MAX * CENTIPAWNS_PER_EVAL_UNIT;
+}
+
+double tuner_sigmoid(double k, double eval)
+{
+    return 1.0 / (1.0 + pow(10.0, -k * eval / 400.0));
+}
+
+typedef struct
+{
+    Tuner* t;
+    int begin;
+    int end;
+    int with_gradient;
+    // one row of TP_N_PARAMS + 1 for each chunk, the error and the gradient
+    double* sums;
+} TunerBatch;
+
+void tuner_batch_body(int begin, int end, void* arg)
+{
+    // adds up the squared errors of chunks [begin, end) of the batch,
+    // and their gradients
+    TunerBatch* b = (TunerBatch*) arg;
+    const Tuner* t = b->t;
+    const double* w = t->params;
+    for (int chunk = begin; chunk < end; chunk++)
+    {
+        double* sums = b->sums + chunk * (TP_N_PARAMS + 1);
+        double* gradient = sums + 1;
+        int first = b->begin + chunk * TUNER_CHUNK;
+        int last = (first + TUNER_CHUNK < b->end) ? first + TUNER_CHUNK : b->end;
+        for (int i = first; i < last; i++)
+        {
+            const TunerPosition* p = &t->positions[i];
+            double mob;
+            double eval = tuner_evaluate(t, p, &mob);
+            double expected = tuner_sigmoid(t->k, eval);
+            double error = p->result * 0.5 - expected;
+            sums[0] += error * error;
+            if (!b->with_gradient)
+                continue;
+
+            // the derivative of the error by the eval, then by every weight
+            double d = -2.0 * error * expected * (1.0 - expected) * t->k * M_LN10 / 400.0;
+            double mg = d * p->phase / PHASE_MAX * CENTIPAWNS_PER_EVAL_UNIT;
+            double eg = d * (PHASE_MAX - p->phase) / PHASE_MAX * CENTIPAWNS_PER_EVAL_UNIT;
+            for (int j = 0; j < 5; j++)
+            {
+                gradient[TP_MATERIAL + 2 * j] += MATERIAL_WEIGHT * mg * p->material[j];
+                gradient[TP_MATERIAL + 2 * j + 1] += MATERIAL_WEIGHT * eg * p->material[j];
+            }
+            for (int j = 0; j < 6; j++)
+            {
+                gradient[TP_SPACE + 2 * j] += SPACE_WEIGHT * mg * p->pawn_rows[j];
+                gradient[TP_SPACE + 2 * j + 1] += SPACE_WEIGHT * eg * p->pawn_rows[j];
+                gradient[TP_PASSED + 2 * j] += MATERIAL_WEIGHT * mg * p->passed_rows[j];
+                gradient[TP_PASSED + 2 * j + 1] += MATERIAL_WEIGHT * eg * p->passed_rows[j];
+            }
+            gradient[TP_ISOLATED] += MATERIAL_WEIGHT * mg * p->isolated;
+            gradient[TP_ISOLATED + 1] += MATERIAL_WEIGHT * eg * p->isolated;
+            gradient[TP_DOUBLED] += MATERIAL_WEIGHT * mg * p->doubled;
+            gradient[TP_DOUBLED + 1] += MATERIAL_WEIGHT * eg * p->doubled;
+            gradient[TP_MG_MOBILITY] += mg * mob;
+            gradient[TP_EG_MOBILITY] += eg * mob;
+            double d_mobility = mg * w[TP_MG_MOBILITY] + eg * w[TP_EG_MOBILITY];
+            for (int j = 0; j < p->n_mobility; j++)
+            {
+                int entry = p->mobility[j];
+                double slope = t->mobility_slope[entry & 3][entry >> 3];
+                gradient[TP_KNIGHT_MOB + (entry & 3)] += (entry & 4) ? -d_mobility * slope : d_mobility * slope;
+            }
+        }
+    }
+}
+
+double tuner_run_batch(Tuner* t, int begin, int end, double* gradient)
+{
+    // returns the summed squared error of positions [begin, end), and adds
+    // the gradient of it to `gradient` if that isn't NULL
+    int n_chunks = (end - begin + TUNER_CHUNK - 1) / TUNER_CHUNK;
+    TunerBatch b = {t, begin, end, gradient != NULL, calloc(n_chunks * (TP_N_PARAMS + 1), sizeof(double))};
+    thread_pool_parallel_for(t->pool, 0, n_chunks, 1, &tuner_batch_body, &b);
+    // added up in the same order every time, so runs repeat exactly
+    double error = 0;
+    for (int chunk = 0; chunk < n_chunks; chunk++)
+    {
+        double* sums = b.sums + chunk * (TP_N_PARAMS + 1);
+        error += sums[0];
+        for (int j = 0; gradient && j < TP_N_PARAMS; j++)
+            gradient[j] += sums[1 + j];
+    }
+    free(b.sums);
+    return error;
+}
+
+double tuner_loss(Tuner* t)
+{
+    // the mean squared error over all the positions
+    tuner_prepare_mobility(t);
+    return tuner_run_batch(t, 0, t->n_positions, NULL) / t->n_positions;
+}
+
+void tuner_fit_k(Tuner* t)
+{
+    // the K that fits the results best with the weights as they are, found
+    // by narrowing down on the minimum, the loss has just the one
+    double low = 0.1, high = 3.0;
+    while (high - low > 0.001)
+    {
+        double a = low + (high - low) / 3, b = high - (high - low) / 3;
+        t->k = a;
+        double loss_a = tuner_loss(t);
+        t->k = b;
+        double loss_b = tuner_loss(t);
+        if (loss_a < loss_b)
+            high = b;
+        else
+            low = a;
+    }
+    t->k = (low + high) / 2;
+}
+
+void tuner_shuffle(Tuner* t)
+{
+    // the batches have to be spread over all the games,
+    // EPD files keep the positions of a game together
+    uint64_t rng = 0x9E3779B97F4A7C15ull;
+    for (int i = t->n_positions - 1; i > 0; i--)
+    {
+        rng ^= rng << 13;
+        rng ^= rng >> 7;
+        rng ^= rng << 17;
+        int j = rng % (i + 1);
+        TunerPosition p = t->positions[i];
+        t->positions[i] = t->positions[j];
+        t->positions[j] = p;
+    }
+}
+
+double tuner_epoch(Tuner* t)
+{
+    // one Adam step per batch, returns the mean squared error over the
+    // epoch, as the weights were when each batch was seen
+    const double beta1 = 0.9, beta2 = 0.999;
+    double error = 0;
+    for (int begin = 0; begin < t->n_positions; begin += t->batch_size)
+    {
+        int end = (begin + t->batch_size < t->n_positions) ? begin + t->batch_size : t->n_positions;
+        double gradient[TP_N_PARAMS] = {0};
+        tuner_prepare_mobility(t);
+        error += tuner_run_batch(t, begin, end, gradient);
+        t->adam_t++;
+        for (int j = 0; j < TP_N_PARAMS; j++)
+        {
+            double g = gradient[j] / (end - begin);
+            t->adam_m[j] = beta1 * t->adam_m[j] + (1 - beta1) * g;
+            t->adam_v[j] = beta2 * t->adam_v[j] + (1 - beta2) * g * g;
+            double m = t->adam_m[j] / (1 - pow(beta1, t->adam_t));
+            double v = t->adam_v[j] / (1 - pow(beta2, t->adam_t));
+            t->params[j] -= t->step[j] * m / (sqrt(v) + 1e-12);
+        }
+        // the eval's mobility term has to stay within what it can hold,
+        // see MOBILITY_BASE_MAX
+        t->params[TP_KNIGHT_MOB] = (t->params[TP_KNIGHT_MOB] < 0.0) ? 0.0
+            : (t->params[TP_KNIGHT_MOB] > MOBILITY_BASE_MAX) ? MOBILITY_BASE_MAX : t->params[TP_KNIGHT_MOB];
+        for (int j = TP_BISHOP_MOB; j <= TP_QUEEN_MOB; j++)
+            t->params[j] = (t->params[j] < 0.5) ? 0.5 : (t->params[j] > MOBILITY_BASE_MAX) ? MOBILITY_BASE_MAX : t->params[j];
+        for (int j = TP_MG_MOBILITY; j <= TP_EG_MOBILITY; j++)
+            t->params[j] = (t->params[j] < 0.0) ? 0.0 : (t->params[j] > MOBILITY_WEIGHT_MAX) ? MOBILITY_WEIGHT_MAX : t->params[j];
+    }
+    return error / t->n_positions;
+}
+
+typedef struct
+{
+    char** lines;
+    TunerPosition* positions;
+    int8_t* ok;
+} TunerLoad;
+
+void tuner_load_body(int begin, int end, void* arg)
+{
+    TunerLoad* load = (TunerLoad*) arg;
+    for (int i = begin; i < end; i++)
+        load->ok[i] = tuner_encode(load->lines[i], &load->positions[i]) == 1;
+}
+
+// how many lines are read in before they're encoded on the pool
+#define TUNER_LOAD_LINES 65536
+
+int tuner_load(Tuner* t, const char* file_name)
+{
+    /*
+     * Adds the positions of an EPD file
+     *
+     * returns the number of positions added
+     *        -1 if the file couldn't be read
+     */
+    FILE* f = fopen(file_name, "r");
+    if (f == NULL)
+    {
+        fprintf(stderr, "tuner: couldn't open %s\n", file_name);
+        return -1;
+    }
+    char** lines = calloc(TUNER_LOAD_LINES, sizeof(char*));
+    size_t* sizes = calloc(TUNER_LOAD_LINES, sizeof(size_t));
+    TunerPosition* positions = malloc(TUNER_LOAD_LINES * sizeof(TunerPosition));
+    int8_t* ok = malloc(TUNER_LOAD_LINES);
+    int n_added = 0;
+    for (;;)
+    {
+        int n_lines = 0;
+        while (n_lines < TUNER_LOAD_LINES && getline(&lines[n_lines], &sizes[n_lines], f) != -1)
+            n_lines++;
+        if (n_lines == 0)
+            break;
+        TunerLoad load = {lines, positions, ok};
+        thread_pool_parallel_for(t->pool, 0, n_lines, 1024, &tuner_load_body, &load);
+
+        if (t->n_positions + n_lines > t->capacity)
+        {
+            t->capacity = 2 * (t->capacity + n_lines);
+            t->positions = realloc(t->positions, t->capacity * sizeof(TunerPosition));
+        }
+        for (int i = 0; i < n_lines; i++)
+        {
+            if (ok[i])
+            {
+                t->positions[t->n_positions++] = positions[i];
+                n_added++;
+            }
+        }
+    }
+    for (int i = 0; i < TUNER_LOAD_LINES; i++)
+        free(lines[i]);
+    free(lines);
+    free(sizes);
+    free(positions);
+    free(ok);
+    fclose(f);
+    return n_added;
+}
+
+int tuner_write_weights(const Tuner* t, const char* file_name, const char* comment)
+{
+    /*
+     * Writes the weights as an eval_weights.h, the material, space and
+     * pawn structure values rounded to the eval's integers
+     *
+     * returns 1 if the file was written
+     *        -1 if it couldn't be
+     */
+    FILE* f = fopen(file_name, "w");
+    if (f == NULL)
+    {
+        fprintf(stderr, "tuner: couldn't write %s\n", file_name);
+        return -1;
+    }
+    const double* w = t->params;
+    const char* pieces[5] = {"PAWN  ", "KNIGHT", "BISHOP", "ROOK  ", "QUEEN "};
+    fprintf(f, "#ifndef EVAL_WEIGHTS_H_\n#define EVAL_WEIGHTS_H_\n\n");
+    fprintf(f, "/*\n * The weights of the classical evaluation, see piece_square.h and evaluation.h\n *\n");
+    fprintf(f, " * Written by tune.out, see tuner.h: %s\n */\n\n", comment);
+    for (int i = 0; i < 5; i++)
+        fprintf(f, "#define MATERIAL_%s SCORE(%ld, %ld)\n", pieces[i],
+                lrint(w[TP_MATERIAL + 2 * i]), lrint(w[TP_MATERIAL + 2 * i + 1]));
+    fprintf(f, "\n");
+    for (int i = 0; i < 6; i++)
+        fprintf(f, "#define PAWN_SPACE_ROW_%d SCORE(%ld, %ld)\n", i + 1,
+                lrint(w[TP_SPACE + 2 * i]), lrint(w[TP_SPACE + 2 * i + 1]));
+    fprintf(f, "\n");
+    for (int i = 0; i < 6; i++)
+        fprintf(f, "#define PASSED_PAWN_ROW_%d SCORE(%ld, %ld)\n", i + 1,
+                lrint(w[TP_PASSED + 2 * i]), lrint(w[TP_PASSED + 2 * i + 1]));
+    fprintf(f, "#define ISOLATED_PAWN SCORE(%ld, %ld)\n", lrint(w[TP_ISOLATED]), lrint(w[TP_ISOLATED + 1]));
+    fprintf(f, "#define DOUBLED_PAWN SCORE(%ld, %ld)\n", lrint(w[TP_DOUBLED]), lrint(w[TP_DOUBLED + 1]));
+    fprintf(f, "\n#define KNIGHT_MOB_VAL %.4f\n", w[TP_KNIGHT_MOB]);
+    fprintf(f, "#define BISHOP_MOB_VAL %.4f\n", w[TP_BISHOP_MOB]);
+    fprintf(f, "#define ROOK_MOB_VAL %.4f\n", w[TP_ROOK_MOB]);
+    fprintf(f, "#define QUEEN_MOB_VAL %.4f\n", w[TP_QUEEN_MOB]);
+    fprintf(f, "\n#define MG_MOBILITY_WEIGHT %.4f\n", w[TP_MG_MOBILITY]);
+    fprintf(f, "#define EG_MOBILITY_WEIGHT %.4f\n", w[TP_EG_MOBILITY]);
+    fprintf(f, "\n#endif // EVAL_WEIGHTS_H_\n");
+    fclose(f);
+    return 1;
+}
+
+void tuner_free(Tuner* t)
+{
+    free(t->positions);
+    t->positions = NULL;
+    t->n_positions = t->capacity = 0;
+}
+
+#endif // TUNER_H_
@@ -0,0 +1,48 @@
+#ifndef ZOBRIST_H_
+#define ZOBRIST_H_
+#include <stdint.h>
+
+/*
+ * Zobrist keys for hashing game states
+ *
+ * The hash of a state is the XOR of one key per (piece, square) on the board,
+ * plus keys for the castle status, the en passant square and the side to move.
+ * The keys are the outputs of splitmix64 on consecutive integers,
+ * written as constant expressions so the tables need no initialization
+ */
+
+#define ZOBRIST_MIX_1(z) (((z) ^ ((z) >> 30)) * 0xBF58476D1CE4E5B9ULL)
+#define ZOBRIST_MIX_2(z) (((z) ^ ((z) >> 27)) * 0x94D049BB133111EBULL)
+#define ZOBRIST_MIX_3(z) ((z) ^ ((z) >> 31))
+#define ZOBRIST_KEY(n) ZOBRIST_MIX_3(ZOBRIST_MIX_2(ZOBRIST_MIX_1(((uint64_t)(n) + 1) * 0x9E3779B97F4A7C15ULL)))
+
+#define ZOBRIST_KEYS_8(n) \
+    ZOBRIST_KEY(n),     ZOBRIST_KEY((n)+1), ZOBRIST_KEY((n)+2), ZOBRIST_KEY((n)+3), \
+    ZOBRIST_KEY((n)+4), ZOBRIST_KEY((n)+5), ZOBRIST_KEY((n)+6), ZOBRIST_KEY((n)+7)
+#define ZOBRIST_KEYS_64(n) \
+    ZOBRIST_KEYS_8(n),      ZOBRIST_KEYS_8((n)+8),  ZOBRIST_KEYS_8((n)+16), ZOBRIST_KEYS_8((n)+24), \
+    ZOBRIST_KEYS_8((n)+32), ZOBRIST_KEYS_8((n)+40), ZOBRIST_KEYS_8((n)+48), ZOBRIST_KEYS_8((n)+56)
+
+// the indeces for this array are the values from the enum PIECES and then the square,
+// the rows for BLANK and the unused value 7 are never read
+const uint64_t zobrist_pieces[14][64] = {
+    {ZOBRIST_KEYS_64(0*64)},  {ZOBRIST_KEYS_64(1*64)},  {ZOBRIST_KEYS_64(2*64)},
+    {ZOBRIST_KEYS_64(3*64)},  {ZOBRIST_KEYS_64(4*64)},  {ZOBRIST_KEYS_64(5*64)},
+    {ZOBRIST_KEYS_64(6*64)},  {ZOBRIST_KEYS_64(7*64)},  {ZOBRIST_KEYS_64(8*64)},
+    {ZOBRIST_KEYS_64(9*64)},  {ZOBRIST_KEYS_64(10*64)}, {ZOBRIST_KEYS_64(11*64)},
+    {ZOBRIST_KEYS_64(12*64)}, {ZOBRIST_KEYS_64(13*64)},
+};
+
+// indexed by the whole 4-bit castles_possible field
+const uint64_t zobrist_castles[16] = { ZOBRIST_KEYS_8(896), ZOBRIST_KEYS_8(904) };
+
+// indexed by the en passant square
+const uint64_t zobrist_en_passant[64] = { ZOBRIST_KEYS_64(912) };
+
+const uint64_t zobrist_black_to_move = ZOBRIST_KEY(976);
+
+// every pawn hash starts from this, so that the hash of a board with no pawns
+// isn't 0, which is what the empty entries of the pawn table hold
+const uint64_t zobrist_pawns_base = ZOBRIST_KEY(977);
+
+#endif // ZOBRIST_H_